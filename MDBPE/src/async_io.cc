@@ -0,0 +1,643 @@
+#include "async_io.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include <omp.h>
+
+#include <rich-log/log.hh>
+
+#include "io.hh"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// openat, statx and close were added together with IORING_FEAT_RW_CUR_POS (Linux 5.6)
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup)
+#define TP_HAS_IO_URING 1
+#endif
+#endif
+
+#ifndef TP_HAS_IO_URING
+#define TP_HAS_IO_URING 0
+#endif
+
+namespace
+{
+int resolve_queue_depth(int queue_depth) { return queue_depth > 0 ? queue_depth : omp_get_max_threads(); }
+
+void warn_io_uring_fallback()
+{
+    static std::atomic<bool> warned = false;
+    if (!warned.exchange(true))
+        LOG_WARN("io_uring is not available, falling back to threaded I/O");
+}
+
+void perform(tp::read_request& request)
+{
+    request.ok = tp::read_file_bytes(request.path, request.offset, request.length, request.data);
+    if (!request.ok)
+        request.data.clear();
+}
+
+void perform(tp::write_request& request) { request.ok = tp::write_file_bytes(request.path, request.data); }
+
+template <class RequestT>
+void run_threaded(cc::span<RequestT> requests, int queue_depth)
+{
+    auto const count = int(requests.size());
+
+#pragma omp parallel for num_threads(queue_depth) schedule(dynamic, 4)
+    for (auto i = 0; i < count; ++i)
+        perform(requests[i]);
+}
+
+// only the requests with the given indices, e.g. the ones io_uring did not finish
+template <class RequestT>
+void run_threaded(cc::span<RequestT> requests, cc::span<size_t const> indices, int queue_depth)
+{
+    auto const count = int(indices.size());
+
+#pragma omp parallel for num_threads(queue_depth) schedule(dynamic, 4)
+    for (auto i = 0; i < count; ++i)
+        perform(requests[indices[i]]);
+}
+
+template <class RequestT>
+bool all_ok(cc::span<RequestT const> requests)
+{
+    auto ok = true;
+    for (auto const& request : requests)
+        ok = ok && request.ok;
+    return ok;
+}
+
+#if TP_HAS_IO_URING
+// minimal io_uring wrapper on the raw syscalls (no liburing dependency)
+// only used from a single thread
+class uring
+{
+public:
+    uring() = default;
+    uring(uring const&) = delete;
+    uring& operator=(uring const&) = delete;
+
+    ~uring()
+    {
+        if (m_sqes)
+            munmap(m_sqes, m_sqes_size);
+        if (m_cq_ptr && m_cq_ptr != m_sq_ptr)
+            munmap(m_cq_ptr, m_cq_size);
+        if (m_sq_ptr)
+            munmap(m_sq_ptr, m_sq_size);
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    bool init(unsigned entries)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        m_fd = int(syscall(__NR_io_uring_setup, entries, &params));
+        if (m_fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS))
+            return false;
+
+        m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        auto const single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap)
+            m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+
+        m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sq_ptr == MAP_FAILED)
+        {
+            m_sq_ptr = nullptr;
+            return false;
+        }
+        m_cq_ptr = single_mmap ? m_sq_ptr : mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ptr == MAP_FAILED)
+        {
+            m_cq_ptr = nullptr;
+            return false;
+        }
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+        if (m_sqes == MAP_FAILED)
+        {
+            m_sqes = nullptr;
+            return false;
+        }
+
+        auto const sq = static_cast<char*>(m_sq_ptr);
+        m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        m_sq_entries = params.sq_entries;
+        m_local_sq_tail = *m_sq_tail;
+
+        auto const cq = static_cast<char*>(m_cq_ptr);
+        m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    /// returns a zeroed submission entry, or nullptr if the submission queue is full
+    io_uring_sqe* next_sqe()
+    {
+        auto const head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_local_sq_tail - head >= m_sq_entries)
+            return nullptr;
+
+        auto const index = m_local_sq_tail & m_sq_mask;
+        m_sq_array[index] = index;
+        auto const sqe = &m_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        ++m_local_sq_tail;
+        ++m_pending_submissions;
+        return sqe;
+    }
+
+    /// submits all queued entries and waits for at least 'wait_count' completions
+    bool submit(unsigned wait_count)
+    {
+        __atomic_store_n(m_sq_tail, m_local_sq_tail, __ATOMIC_RELEASE);
+        while (true)
+        {
+            auto const flags = wait_count > 0 ? IORING_ENTER_GETEVENTS : 0u;
+            auto const result = syscall(__NR_io_uring_enter, m_fd, m_pending_submissions, wait_count, flags, nullptr, 0);
+            if (result >= 0)
+            {
+                m_pending_submissions -= unsigned(result);
+                return true;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                LOG_ERROR("io_uring_enter failed: {}", std::strerror(errno));
+                return false;
+            }
+        }
+    }
+
+    /// waits for at least one completion without submitting anything
+    bool wait()
+    {
+        while (true)
+        {
+            auto const result = syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (result >= 0)
+                return true;
+            if (errno != EINTR)
+            {
+                LOG_ERROR("io_uring_enter failed: {}", std::strerror(errno));
+                return false;
+            }
+        }
+    }
+
+    /// calls 'f' with the user data of every queued entry the kernel has not consumed
+    /// they are never executed if nothing is submitted anymore
+    template <class F>
+    void for_each_unsubmitted(F&& f) const
+    {
+        for (auto i = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE); i != m_local_sq_tail; ++i)
+            f(m_sqes[m_sq_array[i & m_sq_mask]].user_data);
+    }
+
+    /// pops the next completion, returns false if there is none
+    bool pop(io_uring_cqe& cqe)
+    {
+        auto const head = *m_cq_head;
+        if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+        cqe = m_cqes[head & m_cq_mask];
+        __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    int m_fd = -1;
+
+    void* m_sq_ptr = nullptr;
+    size_t m_sq_size = 0;
+    void* m_cq_ptr = nullptr;
+    size_t m_cq_size = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqes_size = 0;
+
+    unsigned* m_sq_head = nullptr;
+    unsigned* m_sq_tail = nullptr;
+    unsigned* m_sq_array = nullptr;
+    unsigned m_sq_mask = 0;
+    unsigned m_sq_entries = 0;
+    unsigned m_local_sq_tail = 0;       // entries up to here are filled but not yet published
+    unsigned m_pending_submissions = 0; // entries the kernel has not consumed yet
+
+    unsigned* m_cq_head = nullptr;
+    unsigned* m_cq_tail = nullptr;
+    unsigned m_cq_mask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+};
+
+// every request goes through open -> (statx) -> read/write (repeated on short transfers) -> close
+// a request has at most one operation in flight, so 'queue_depth' requests never overflow the rings
+enum class stage
+{
+    open,
+    stat,
+    transfer,
+    close,
+};
+
+struct request_state
+{
+    int fd = -1;
+    stage current = stage::open;
+    size_t done = 0;
+    bool failed = false;
+    bool pending = false;  // an operation is queued or in the kernel
+    bool finished = false; // ok and data of the request are final
+    struct statx stat;
+};
+
+// single transfers are limited to 2 GiB by the kernel
+constexpr size_t max_transfer_bytes = size_t(1) << 30;
+
+void prep_open(io_uring_sqe* sqe, char const* path, int flags)
+{
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = uint64_t(uintptr_t(path));
+    sqe->len = 0644; // mode for created files
+    sqe->open_flags = uint32_t(flags | O_CLOEXEC);
+}
+
+void prep_statx(io_uring_sqe* sqe, int fd, struct statx* stat)
+{
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = fd;
+    sqe->addr = uint64_t(uintptr_t(""));
+    sqe->len = STATX_SIZE;
+    sqe->off = uint64_t(uintptr_t(stat));
+    sqe->statx_flags = AT_EMPTY_PATH;
+}
+
+void prep_transfer(io_uring_sqe* sqe, bool write, int fd, std::byte const* data, size_t size, size_t offset)
+{
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = uint64_t(uintptr_t(data));
+    sqe->len = uint32_t(std::min(size, max_transfer_bytes));
+    sqe->off = offset;
+}
+
+void prep_close(io_uring_sqe* sqe, int fd)
+{
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
+
+// drives all read or write requests through their stages
+// returns false if the ring failed; 'unfinished' then lists the requests it did not finish, none of them has an open fd or an
+// operation in flight anymore, so they can be performed by another backend
+template <bool Write, class RequestT>
+bool run_uring(uring& ring, cc::span<RequestT> requests, int queue_depth, cc::vector<size_t>& unfinished)
+{
+    auto const count = requests.size();
+    cc::vector<request_state> states;
+    states.resize(count);
+
+    auto broken = false; // no new operations are queued once the ring failed
+    auto pending_count = 0;
+    auto in_flight = 0; // started, but not finished
+
+    // returns the submission entry for the next operation of request i, or nullptr if the ring failed
+    auto const queue = [&](size_t i) -> io_uring_sqe*
+    {
+        if (broken)
+            return nullptr;
+        auto const sqe = ring.next_sqe();
+        if (!sqe)
+        {
+            LOG_ERROR("io_uring submission queue is unexpectedly full");
+            broken = true;
+            return nullptr;
+        }
+        sqe->user_data = i;
+        states[i].pending = true;
+        ++pending_count;
+        return sqe;
+    };
+
+    // queues the transfer, or the close of a failed request
+    auto const advance = [&](size_t i)
+    {
+        auto& request = requests[i];
+        auto& state = states[i];
+        auto const sqe = queue(i);
+        if (!sqe)
+            return;
+
+        if (state.failed)
+        {
+            state.current = stage::close;
+            prep_close(sqe, state.fd);
+            return;
+        }
+
+        if constexpr (Write)
+        {
+            prep_transfer(sqe, true, state.fd, request.data.data() + state.done, request.data.size() - state.done, state.done);
+        }
+        else
+        {
+            prep_transfer(sqe, false, state.fd, request.data.data() + state.done, request.data.size() - state.done, request.offset + state.done);
+        }
+        state.current = stage::transfer;
+    };
+
+    auto const fail = [&](size_t i, char const* operation, int error)
+    {
+        LOG_ERROR("Could not {} {}: {}", operation, requests[i].path, std::strerror(error));
+        states[i].failed = true;
+    };
+
+    auto const finish = [&](size_t i)
+    {
+        auto& request = requests[i];
+        request.ok = !states[i].failed;
+        if constexpr (!Write)
+        {
+            if (states[i].failed)
+                request.data.clear();
+        }
+        states[i].finished = true;
+        --in_flight;
+    };
+
+    auto const complete = [&](io_uring_cqe const& cqe)
+    {
+        auto const i = size_t(cqe.user_data);
+        auto& request = requests[i];
+        auto& state = states[i];
+        state.pending = false;
+        --pending_count;
+
+        switch (state.current)
+        {
+        case stage::open:
+            if (cqe.res < 0)
+            {
+                fail(i, "open", -cqe.res);
+                finish(i);
+                break;
+            }
+            state.fd = cqe.res;
+            if constexpr (!Write)
+            {
+                if (request.length == 0)
+                {
+                    // the size is only known after a statx
+                    if (auto const sqe = queue(i))
+                    {
+                        prep_statx(sqe, state.fd, &state.stat);
+                        state.current = stage::stat;
+                    }
+                    break;
+                }
+                request.data.resize(request.length);
+            }
+            advance(i);
+            break;
+
+        case stage::stat:
+            if constexpr (!Write)
+            {
+                if (cqe.res < 0)
+                    fail(i, "stat", -cqe.res);
+                else if (state.stat.stx_size < request.offset)
+                    fail(i, "read past the end of", EINVAL);
+                else
+                    request.data.resize(size_t(state.stat.stx_size - request.offset));
+            }
+            advance(i);
+            break;
+
+        case stage::transfer:
+            if (cqe.res < 0)
+                fail(i, Write ? "write" : "read", -cqe.res);
+            else if (cqe.res == 0 && state.done < request.data.size())
+                fail(i, Write ? "write" : "read", Write ? EIO : ENODATA);
+            else
+                state.done += size_t(cqe.res);
+
+            if (!state.failed && state.done < request.data.size())
+            {
+                advance(i); // short transfer, continue where it stopped
+            }
+            else if (auto const sqe = queue(i))
+            {
+                prep_close(sqe, state.fd);
+                state.current = stage::close;
+            }
+            break;
+
+        case stage::close:
+            state.fd = -1;
+            finish(i);
+            break;
+        }
+    };
+
+    size_t next_request = 0;
+    io_uring_cqe cqe;
+
+    while (!broken && (next_request < count || in_flight > 0))
+    {
+        // fill the queue with new requests
+        while (next_request < count && in_flight < queue_depth)
+        {
+            auto const sqe = queue(next_request);
+            if (!sqe)
+                break;
+            prep_open(sqe, requests[next_request].path.c_str(), Write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY);
+            ++next_request;
+            ++in_flight;
+        }
+
+        if (broken || !ring.submit(1))
+        {
+            broken = true;
+            break;
+        }
+
+        while (ring.pop(cqe))
+            complete(cqe);
+    }
+
+    if (broken)
+    {
+        // entries the kernel has not consumed are dropped with the ring, everything else has to complete before its buffers are reused
+        ring.for_each_unsubmitted(
+            [&](uint64_t i)
+            {
+                if (states[i].pending)
+                {
+                    states[i].pending = false;
+                    --pending_count;
+                }
+            });
+        while (pending_count > 0 && ring.wait())
+            while (ring.pop(cqe))
+                complete(cqe);
+
+        for (size_t i = 0; i < count; ++i)
+            if (states[i].pending)
+            {
+                // the kernel still owns the buffer, so the request can neither be retried nor closed
+                fail(i, Write ? "finish writing" : "finish reading", EIO);
+                requests[i].ok = false;
+                states[i].finished = true;
+                states[i].fd = -1;
+            }
+    }
+
+    // descriptors of requests that stopped between two operations
+    for (auto& state : states)
+        if (state.fd >= 0)
+        {
+            close(state.fd);
+            state.fd = -1;
+        }
+
+    for (size_t i = 0; i < count; ++i)
+        if (!states[i].finished)
+            unfinished.push_back(i);
+    return !broken;
+}
+
+// performs the requests on the ring and hands everything it did not finish to the threaded backend if it fails
+// returns false if the ring failed and should not be used again
+template <bool Write, class RequestT>
+bool run_uring_with_fallback(uring& ring, cc::span<RequestT> requests, int queue_depth)
+{
+    cc::vector<size_t> unfinished;
+    if (run_uring<Write>(ring, requests, queue_depth, unfinished))
+        return true;
+
+    LOG_WARN("io_uring failed, performing the remaining {} requests with threaded I/O", unfinished.size());
+    run_threaded(requests, cc::span<size_t const>(unfinished), queue_depth);
+    return false;
+}
+#endif
+}
+
+bool tp::io_uring_available()
+{
+#if TP_HAS_IO_URING
+    static bool const available = []
+    {
+        uring ring;
+        return ring.init(1);
+    }();
+    return available;
+#else
+    return false;
+#endif
+}
+
+#if TP_HAS_IO_URING
+struct tp::io_queue::ring
+{
+    uring instance;
+};
+#else
+struct tp::io_queue::ring
+{
+};
+#endif
+
+tp::io_queue::io_queue(int queue_depth, io_backend backend)
+  : m_queue_depth{resolve_queue_depth(queue_depth)},
+    m_backend{backend}
+{
+}
+
+tp::io_queue::~io_queue() = default;
+
+tp::io_queue::ring* tp::io_queue::acquire_ring()
+{
+    if (m_backend != io_backend::io_uring)
+        return nullptr;
+
+#if TP_HAS_IO_URING
+    if (!m_ring)
+    {
+        m_ring = std::make_unique<ring>();
+        if (!io_uring_available() || !m_ring->instance.init(unsigned(m_queue_depth)))
+            m_ring = nullptr;
+    }
+#endif
+
+    // a ring that could not be set up or failed is not tried again
+    if (!m_ring)
+    {
+        warn_io_uring_fallback();
+        m_backend = io_backend::threads;
+    }
+    return m_ring.get();
+}
+
+bool tp::io_queue::read(cc::span<read_request> requests)
+{
+    [[maybe_unused]] auto const r = acquire_ring();
+#if TP_HAS_IO_URING
+    if (r)
+    {
+        if (!run_uring_with_fallback<false>(r->instance, requests, m_queue_depth))
+        {
+            m_ring = nullptr;
+            m_backend = io_backend::threads;
+        }
+        return all_ok(cc::span<read_request const>(requests));
+    }
+#endif
+
+    run_threaded(requests, m_queue_depth);
+    return all_ok(cc::span<read_request const>(requests));
+}
+
+bool tp::io_queue::write(cc::span<write_request> requests)
+{
+    [[maybe_unused]] auto const r = acquire_ring();
+#if TP_HAS_IO_URING
+    if (r)
+    {
+        if (!run_uring_with_fallback<true>(r->instance, requests, m_queue_depth))
+        {
+            m_ring = nullptr;
+            m_backend = io_backend::threads;
+        }
+        return all_ok(cc::span<write_request const>(requests));
+    }
+#endif
+
+    run_threaded(requests, m_queue_depth);
+    return all_ok(cc::span<write_request const>(requests));
+}
+
+bool tp::read_files(cc::span<read_request> requests, int queue_depth, io_backend backend) { return io_queue(queue_depth, backend).read(requests); }
+
+bool tp::write_files(cc::span<write_request> requests, int queue_depth, io_backend backend)
+{
+    return io_queue(queue_depth, backend).write(requests);
+}
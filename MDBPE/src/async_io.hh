@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+#include <clean-core/span.hh>
+#include <clean-core/string.hh>
+#include <clean-core/vector.hh>
+
+#include "settings.hh"
+
+namespace tp
+{
+/// reads 'length' bytes at 'offset' of 'path' into 'data' (length 0 = up to the end of the file)
+struct read_request
+{
+    cc::string path;
+    size_t offset = 0;
+    size_t length = 0;
+    cc::vector<std::byte> data; // result
+    bool ok = false;            // result, errors are reported
+};
+
+/// writes 'data' to 'path', replacing the file
+struct write_request
+{
+    cc::string path;
+    cc::vector<std::byte> data;
+    bool ok = false; // result, errors are reported
+};
+
+/// performs batches of reads and writes with up to 'queue_depth' operations in flight (0 = one per core)
+/// the io_uring instance is set up on first use and reused for all later batches, so a batch loop should keep one queue
+/// if io_uring cannot be set up or fails, the remaining requests are performed by the threaded backend
+/// a queue is used by a single thread
+struct io_queue
+{
+public:
+    io_queue(int queue_depth, io_backend backend);
+    ~io_queue();
+
+    io_queue(io_queue const&) = delete;
+    io_queue& operator=(io_queue const&) = delete;
+
+    /// returns false if any of the reads failed (failed reads are reported and left empty)
+    bool read(cc::span<read_request> requests);
+
+    /// returns false if any of the writes failed
+    bool write(cc::span<write_request> requests);
+
+private:
+    struct ring; // io_uring state, see async_io.cc
+
+    ring* acquire_ring();
+
+    std::unique_ptr<ring> m_ring;
+    int m_queue_depth = 0;
+    io_backend m_backend = io_backend::threads;
+};
+
+/// performs all reads with up to 'queue_depth' of them in flight (0 = one per core), with a queue for a single batch
+/// returns false if any of them failed
+bool read_files(cc::span<read_request> requests, int queue_depth, io_backend backend);
+
+/// performs all writes with up to 'queue_depth' of them in flight (0 = one per core), with a queue for a single batch
+/// returns false if any of them failed
+bool write_files(cc::span<write_request> requests, int queue_depth, io_backend backend);
+
+/// returns true if io_uring can be used on this system (checked once)
+bool io_uring_available();
+}
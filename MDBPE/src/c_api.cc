@@ -0,0 +1,269 @@
+#include "c_api.h"
+
+#include <climits>
+#include <cstddef>
+#include <new>
+
+#include <clean-core/string.hh>
+#include <clean-core/vector.hh>
+
+#include <rich-log/log.hh>
+
+#include "decoder.hh"
+#include "encoder.hh"
+#include "image_data.hh"
+#include "tokenizer.hh"
+#include "vocabulary.hh"
+
+static_assert(sizeof(tp_token) == sizeof(tp::sequence_token), "tp_token has to alias tp::sequence_token");
+static_assert(offsetof(tp_token, x) == offsetof(tp::sequence_token, ancor), "tp_token has to alias tp::sequence_token");
+
+struct tp_vocabulary
+{
+    explicit tp_vocabulary(tp::vocabulary vocabulary)
+      : vocabulary{cc::move(vocabulary)},
+        encoder{this->vocabulary},
+        decoder{this->vocabulary}
+    {
+    }
+
+    bool valid() const { return encoder.valid() && decoder.valid(); }
+
+    tp::vocabulary vocabulary;
+    tp::encoder encoder;
+    tp::decoder decoder;
+};
+
+namespace
+{
+/// runs 'f' and turns exceptions into TP_INTERNAL_ERROR, they must not cross the C ABI
+template <class F>
+tp_status guarded(char const* function, F&& f)
+{
+    try
+    {
+        return f();
+    }
+    catch (std::bad_alloc const&)
+    {
+        LOG_ERROR("{}: out of memory", function);
+    }
+    catch (...)
+    {
+        LOG_ERROR("{}: unexpected exception", function);
+    }
+    return TP_INTERNAL_ERROR;
+}
+
+/// checks the extents of a [count, height, width] tensor, the encoder and decoder index images and tokens with int
+bool valid_extents(char const* function, int64_t count, int32_t height, int32_t width)
+{
+    if (count < 0 || count > INT_MAX || height <= 0 || width <= 0 || int64_t(height) * width > INT_MAX)
+    {
+        LOG_ERROR("{}: invalid tensor shape [{}, {}, {}]", function, count, height, width);
+        return false;
+    }
+    return true;
+}
+
+tp_status make_vocabulary(tp::vocabulary vocabulary, tp_vocabulary** result)
+{
+    auto handle = new tp_vocabulary(cc::move(vocabulary));
+    if (!handle->valid())
+    {
+        delete handle;
+        return TP_IO_ERROR;
+    }
+    *result = handle;
+    return TP_OK;
+}
+}
+
+int32_t tp_api_version(void) { return TP_C_API_VERSION; }
+
+char const* tp_status_string(tp_status status)
+{
+    switch (status)
+    {
+    case TP_OK:
+        return "ok";
+    case TP_INVALID_ARGUMENT:
+        return "invalid argument";
+    case TP_INVALID_CLASSES:
+        return "invalid classes";
+    case TP_IO_ERROR:
+        return "I/O error";
+    case TP_INTERNAL_ERROR:
+        return "internal error";
+    }
+    return "unknown status";
+}
+
+tp_status tp_train(int32_t const* classes,
+                   int64_t count,
+                   int32_t height,
+                   int32_t width,
+                   int32_t class_count,
+                   int32_t tokens_to_create,
+                   tp_vocabulary** vocabulary,
+                   int32_t* rules_learned)
+{
+    if (rules_learned)
+        *rules_learned = 0;
+    if (!vocabulary || !classes || count == 0 || class_count <= 0 || tokens_to_create < 0 || !valid_extents("tp_train", count, height, width))
+        return TP_INVALID_ARGUMENT;
+    *vocabulary = nullptr;
+
+    return guarded("tp_train",
+                   [&]
+                   {
+                       // the rules index tokens by class, so out-of-range classes have to be rejected before training
+                       auto const pixel_count = size_t(width) * size_t(height);
+                       auto const value_count = size_t(count) * pixel_count;
+                       for (size_t i = 0; i < value_count; ++i)
+                           if (classes[i] < 0 || classes[i] >= class_count)
+                           {
+                               LOG_ERROR("tp_train: image {} contains class {}, expected [0, {})", i / pixel_count, classes[i], class_count);
+                               return TP_INVALID_CLASSES;
+                           }
+
+                       // the images read the caller's tensor like a mapped plane, it is only widened into the working planes
+                       cc::vector<tp::image_data> images;
+                       images.reserve(size_t(count));
+                       for (auto i = 0; i < int(count); ++i)
+                       {
+                           auto const plane = reinterpret_cast<std::byte const*>(classes + size_t(i) * pixel_count);
+                           images.emplace_back(cc::string_view(), i, tg::isize2(width, height), plane, 4, nullptr);
+                       }
+
+                       auto trained = tp::train_vocabulary(images, class_count, tokens_to_create);
+                       auto const learned = int32_t(trained.rules.size());
+                       auto const status = make_vocabulary(cc::move(trained), vocabulary);
+                       if (status == TP_OK && rules_learned)
+                           *rules_learned = learned;
+                       return status;
+                   });
+}
+
+tp_status tp_load_vocabulary(char const* path, tp_vocabulary** vocabulary)
+{
+    if (!path || !vocabulary)
+        return TP_INVALID_ARGUMENT;
+    *vocabulary = nullptr;
+
+    return guarded("tp_load_vocabulary",
+                   [&]
+                   {
+                       tp::vocabulary loaded;
+                       if (!tp::read_vocabulary(path, loaded))
+                           return TP_IO_ERROR;
+                       return make_vocabulary(cc::move(loaded), vocabulary);
+                   });
+}
+
+tp_status tp_save_vocabulary(tp_vocabulary const* vocabulary, char const* path)
+{
+    if (!vocabulary || !path)
+        return TP_INVALID_ARGUMENT;
+
+    return guarded("tp_save_vocabulary",
+                   [&]
+                   {
+                       auto const& v = vocabulary->vocabulary;
+                       return tp::write_vocabulary(path, v.rules, v.tokens, v.class_count) ? TP_OK : TP_IO_ERROR;
+                   });
+}
+
+void tp_free_vocabulary(tp_vocabulary* vocabulary) { delete vocabulary; }
+
+int32_t tp_vocabulary_class_count(tp_vocabulary const* vocabulary) { return vocabulary ? vocabulary->encoder.class_count() : 0; }
+
+int32_t tp_vocabulary_token_count(tp_vocabulary const* vocabulary) { return vocabulary ? vocabulary->encoder.token_count() : 0; }
+
+tp_status tp_encode_batch(tp_vocabulary const* vocabulary,
+                          int32_t const* classes,
+                          int64_t count,
+                          int32_t height,
+                          int32_t width,
+                          tp_token* tokens,
+                          int64_t token_capacity,
+                          int64_t* offsets,
+                          int64_t* first_invalid,
+                          int32_t worker_count)
+{
+    if (first_invalid)
+        *first_invalid = -1;
+    if (!vocabulary || !offsets || !valid_extents("tp_encode_batch", count, height, width))
+        return TP_INVALID_ARGUMENT;
+    auto const slot_tokens = count * height * width;
+    if (count > 0 && (!classes || !tokens || token_capacity < slot_tokens))
+    {
+        LOG_ERROR("tp_encode_batch: the token buffer needs room for count * height * width = {} tokens", slot_tokens);
+        return TP_INVALID_ARGUMENT;
+    }
+
+    return guarded("tp_encode_batch",
+                   [&]
+                   {
+                       // workspaces are per calling thread, so data loader threads can encode concurrently and still reuse them
+                       thread_local cc::vector<tp::encoder_workspace> workspaces;
+
+                       auto const token_span = cc::span<tp::sequence_token>(reinterpret_cast<tp::sequence_token*>(tokens), size_t(slot_tokens));
+                       auto const offset_span = cc::span<int64_t>(offsets, size_t(count) + 1);
+                       auto const invalid = tp::encode_batch(vocabulary->encoder,
+                                                             classes,
+                                                             int(count),
+                                                             height,
+                                                             width,
+                                                             token_span,
+                                                             offset_span,
+                                                             workspaces,
+                                                             worker_count);
+                       if (invalid < 0)
+                           return TP_OK;
+                       if (first_invalid)
+                           *first_invalid = invalid;
+                       return TP_INVALID_CLASSES;
+                   });
+}
+
+tp_status tp_decode_batch(tp_vocabulary const* vocabulary,
+                          tp_token const* tokens,
+                          int64_t const* offsets,
+                          int64_t count,
+                          int32_t height,
+                          int32_t width,
+                          int32_t fill,
+                          int32_t* classes,
+                          int32_t worker_count)
+{
+    if (!vocabulary || !offsets || !valid_extents("tp_decode_batch", count, height, width) || (count > 0 && !classes))
+        return TP_INVALID_ARGUMENT;
+
+    // a sequence longer than its image has pixels cannot come from the encoder
+    auto const pixel_count = int64_t(height) * width;
+    if (offsets[0] != 0)
+    {
+        LOG_ERROR("tp_decode_batch: offsets have to start at 0");
+        return TP_INVALID_ARGUMENT;
+    }
+    for (int64_t i = 0; i < count; ++i)
+        if (offsets[i + 1] < offsets[i] || offsets[i + 1] - offsets[i] > pixel_count)
+        {
+            LOG_ERROR("tp_decode_batch: invalid sequence {} in [{}, {})", i, offsets[i], offsets[i + 1]);
+            return TP_INVALID_ARGUMENT;
+        }
+    if (offsets[count] > 0 && !tokens)
+        return TP_INVALID_ARGUMENT;
+
+    return guarded("tp_decode_batch",
+                   [&]
+                   {
+                       auto const token_span
+                           = cc::span<tp::sequence_token const>(reinterpret_cast<tp::sequence_token const*>(tokens), size_t(offsets[count]));
+                       auto const offset_span = cc::span<int64_t const>(offsets, size_t(count) + 1);
+                       if (!tp::decode_batch(vocabulary->decoder, token_span, offset_span, classes, height, width, fill, worker_count))
+                           return TP_INVALID_CLASSES;
+                       return TP_OK;
+                   });
+}
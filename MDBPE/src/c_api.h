@@ -0,0 +1,116 @@
+#pragma once
+
+/// C ABI of the tokenizer, exported from the tokenprocessor-c shared library
+///
+/// all tensors are caller-owned, contiguous and row-major, so numpy arrays or torch tensors can be passed by pointer
+/// (e.g. ctypes with arr.ctypes.data / tensor.data_ptr()) and are neither copied nor kept after a call returns
+/// errors are returned as tp_status and reported through the log; no C++ exception leaves the library
+///
+/// typical use:
+///   tp_train(classes, N, H, W, class_count, tokens_to_create, &vocabulary, NULL);    or tp_load_vocabulary("vocabulary.vocab", &vocabulary);
+///   tp_encode_batch(vocabulary, classes, N, H, W, tokens, N * H * W, offsets, NULL, 0);   tokens of image i: [offsets[i], offsets[i + 1])
+///   tp_decode_batch(vocabulary, tokens, offsets, N, H, W, -1, classes, 0);
+///   tp_free_vocabulary(vocabulary);
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#ifdef TP_C_DLL
+#define TP_C_API __declspec(dllexport)
+#else
+#define TP_C_API __declspec(dllimport)
+#endif
+#else
+#define TP_C_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/// incremented whenever a signature or struct layout changes
+#define TP_C_API_VERSION 2
+
+typedef enum tp_status
+{
+    TP_OK = 0,
+    TP_INVALID_ARGUMENT = 1, // null pointer, negative or too large size, buffer too small
+    TP_INVALID_CLASSES = 2,  // a class outside of [0, class count) or a token class outside of the vocabulary
+    TP_IO_ERROR = 3,         // vocabulary file missing, corrupted or not writable
+    TP_INTERNAL_ERROR = 4,   // out of memory or another unexpected failure
+} tp_status;
+
+/// a token of a sequence, same layout as a raw sequence file entry (12 bytes, see sequence_codec.hh)
+/// a numpy view is np.dtype([("token_class", "<i4"), ("x", "<i4"), ("y", "<i4")]) or an int32 array of shape [T, 3]
+typedef struct tp_token
+{
+    int32_t token_class;
+    int32_t x; // ancor
+    int32_t y;
+} tp_token;
+
+/// a vocabulary with a prepared encoder and decoder; immutable, so it can be used from any number of threads
+typedef struct tp_vocabulary tp_vocabulary;
+
+/// returns TP_C_API_VERSION of the library, to check it against the header a binding was written for
+TP_C_API int32_t tp_api_version(void);
+
+/// short description of a status code (static string)
+TP_C_API char const* tp_status_string(tp_status status);
+
+/// learns a vocabulary with up to 'tokens_to_create' new tokens from a [count, height, width] int32 tensor with classes in [0, class_count)
+/// the tensor is only read and needs at least one image; like tokenize, this keeps a working copy of all images in memory
+/// training stops early once the images contain no constellation, the number of created tokens is stored in 'rules_learned' (optional)
+TP_C_API tp_status tp_train(int32_t const* classes,
+                            int64_t count,
+                            int32_t height,
+                            int32_t width,
+                            int32_t class_count,
+                            int32_t tokens_to_create,
+                            tp_vocabulary** vocabulary,
+                            int32_t* rules_learned);
+
+/// reads a vocabulary file written by tokenize or tp_save_vocabulary (see vocabulary.hh)
+TP_C_API tp_status tp_load_vocabulary(char const* path, tp_vocabulary** vocabulary);
+
+TP_C_API tp_status tp_save_vocabulary(tp_vocabulary const* vocabulary, char const* path);
+
+/// frees a vocabulary of tp_train or tp_load_vocabulary, null is ignored
+TP_C_API void tp_free_vocabulary(tp_vocabulary* vocabulary);
+
+/// initial classes (token_max + 1) and total tokens including the created ones
+TP_C_API int32_t tp_vocabulary_class_count(tp_vocabulary const* vocabulary);
+TP_C_API int32_t tp_vocabulary_token_count(tp_vocabulary const* vocabulary);
+
+/// encodes a [count, height, width] int32 tensor into ragged token sequences on 'worker_count' threads (0 = one per core)
+/// 'tokens' is used as scratch space and needs 'token_capacity' >= count * height * width; the sequences end up compacted at its
+/// start, the tokens of image i are tokens[offsets[i], offsets[i + 1]) and 'offsets' needs count + 1 entries
+/// if an image contains invalid classes, its sequence is empty, TP_INVALID_CLASSES is returned and the index of the first one is
+/// stored in 'first_invalid' (optional, set to -1 otherwise)
+TP_C_API tp_status tp_encode_batch(tp_vocabulary const* vocabulary,
+                                   int32_t const* classes,
+                                   int64_t count,
+                                   int32_t height,
+                                   int32_t width,
+                                   tp_token* tokens,
+                                   int64_t token_capacity,
+                                   int64_t* offsets,
+                                   int64_t* first_invalid,
+                                   int32_t worker_count);
+
+/// decodes ragged token sequences (as written by tp_encode_batch) into a [count, height, width] int32 tensor
+/// pixels no token covers are set to 'fill'; runs on 'worker_count' threads (0 = one per core)
+TP_C_API tp_status tp_decode_batch(tp_vocabulary const* vocabulary,
+                                   tp_token const* tokens,
+                                   int64_t const* offsets,
+                                   int64_t count,
+                                   int32_t height,
+                                   int32_t width,
+                                   int32_t fill,
+                                   int32_t* classes,
+                                   int32_t worker_count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -13,4 +13,11 @@ struct constellation
 
     bool operator==(constellation const&) const = default;
 };
+
+/// a constellation and how often it occurs in an image
+struct counted_constellation
+{
+    tp::constellation constellation;
+    int count = 0;
+};
 }
@@ -0,0 +1,157 @@
+#include "contact_sheet.hh"
+
+#include <cstring>
+
+#include <typed-geometry/tg.hh>
+
+#include <rich-log/log.hh>
+
+#include <cpp-utils/filesystem.hh>
+
+#include "io.hh"
+
+namespace
+{
+// sheets waiting for the encoder, composing blocks while it is behind
+constexpr size_t max_pending_sheets = 2;
+
+// gap between tiles and between the class and id plane of a tile, in output pixels
+constexpr int tile_gap = 4;
+constexpr auto background = std::byte(32);
+}
+
+tp::contact_sheet_writer::contact_sheet_writer(cc::string folder, cc::span<tg::color3 const> colors, settings const& settings)
+  : m_folder{cc::move(folder)},
+    m_image_stride{tg::max(0, settings.debug_image_stride)},
+    m_iteration_stride{tg::max(1, settings.debug_iteration_stride)},
+    m_max_tiles{tg::max(1, settings.debug_max_tiles)},
+    m_upscale{tg::max(1, settings.debug_upscale)}
+{
+    if (!enabled())
+        return;
+
+    m_palette.resize(colors.size() * 3);
+    for (size_t i = 0; i < colors.size(); ++i)
+    {
+        m_palette[3 * i + 0] = std::byte(tg::clamp(colors[i].r, 0.f, 1.f) * 255);
+        m_palette[3 * i + 1] = std::byte(tg::clamp(colors[i].g, 0.f, 1.f) * 255);
+        m_palette[3 * i + 2] = std::byte(tg::clamp(colors[i].b, 0.f, 1.f) * 255);
+    }
+
+    util::make_directories(m_folder);
+    m_encoder = std::thread([this] { work(); });
+}
+
+tp::contact_sheet_writer::~contact_sheet_writer() { finish(); }
+
+void tp::contact_sheet_writer::render(cc::span<image_data const> images, int iteration)
+{
+    if (!enabled() || images.empty() || m_palette.empty())
+        return;
+    if (iteration >= 0 && (iteration + 1) % m_iteration_stride != 0)
+        return;
+
+    auto const tile_count = int(tg::min(size_t(m_max_tiles), (images.size() + m_image_stride - 1) / m_image_stride));
+
+    // tiles are sized for the largest sampled image, smaller ones are drawn in the top left corner
+    auto cells = tg::isize2(0, 0);
+    for (auto t = 0; t < tile_count; ++t)
+    {
+        auto const extents = images[size_t(t) * m_image_stride].extents();
+        cells.width = tg::max(cells.width, extents.width);
+        cells.height = tg::max(cells.height, extents.height);
+    }
+
+    // a tile shows the class plane and the id plane next to each other
+    auto const plane_width = cells.width * m_upscale;
+    auto const tile_width = 2 * plane_width + tile_gap;
+    auto const tile_height = cells.height * m_upscale;
+    auto const columns = tg::max(1, int(tg::ceil(tg::sqrt(float(tile_count)))));
+    auto const rows = (tile_count + columns - 1) / columns;
+
+    pending_sheet sheet;
+    sheet.path = m_folder + cc::format("sheet_{:06}.png", iteration + 1);
+    auto& image = sheet.image;
+    image.channels = babel::image::channels::rgb;
+    image.bit_depth = babel::image::bit_depth::u8;
+    image.width = columns * (tile_width + tile_gap) + tile_gap;
+    image.height = rows * (tile_height + tile_gap) + tile_gap;
+    image.bytes = cc::array<std::byte>::filled(size_t(image.width) * image.height * 3, background);
+
+    auto const stride = size_t(image.width) * 3;
+    auto const color_count = int(m_palette.size() / 3);
+
+#pragma omp parallel for schedule(dynamic, 4)
+    for (auto t = 0; t < tile_count; ++t)
+    {
+        image_data scratch; // decompression target for compressed images
+        auto const& source = images[size_t(t) * m_image_stride].decompressed(scratch);
+        auto const tile_x = tile_gap + (t % columns) * (tile_width + tile_gap);
+        auto const tile_y = tile_gap + (t / columns) * (tile_height + tile_gap);
+
+        auto draw_plane = [&](img::image<int> const& plane, int plane_x)
+        {
+            for (auto y = 0; y < plane.height(); ++y)
+            {
+                // the first output row of a cell row is drawn, the other upscale - 1 rows are copies of it
+                auto const first_row = image.bytes.data() + size_t(tile_y + y * m_upscale) * stride + size_t(plane_x) * 3;
+                auto dst = first_row;
+                for (auto x = 0; x < plane.width(); ++x)
+                {
+                    auto const value = plane(x, y);
+                    auto const color = m_palette.data() + 3 * size_t((value % color_count + color_count) % color_count);
+                    for (auto dx = 0; dx < m_upscale; ++dx, dst += 3)
+                        std::memcpy(dst, color, 3);
+                }
+                for (auto dy = 1; dy < m_upscale; ++dy)
+                    std::memcpy(first_row + size_t(dy) * stride, first_row, size_t(plane.width() * m_upscale) * 3);
+            }
+        };
+        draw_plane(source.current_token_class, tile_x);
+        draw_plane(source.current_token_id, tile_x + plane_width + tile_gap);
+    }
+
+    std::unique_lock lock(m_mutex);
+    m_not_full.wait(lock, [&] { return m_queue.size() < max_pending_sheets; });
+    m_queue.push_back(cc::move(sheet));
+    lock.unlock();
+    m_not_empty.notify_one();
+}
+
+void tp::contact_sheet_writer::finish()
+{
+    if (!m_encoder.joinable())
+        return;
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_closing = true;
+    }
+    m_not_empty.notify_all();
+    m_encoder.join();
+}
+
+void tp::contact_sheet_writer::work()
+{
+    while (true)
+    {
+        pending_sheet sheet;
+        {
+            std::unique_lock lock(m_mutex);
+            m_not_empty.wait(lock, [&] { return !m_queue.empty() || m_closing; });
+            if (m_queue.empty())
+                return; // closing and drained
+            sheet = cc::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        m_not_full.notify_one();
+
+        cc::vector<std::byte> png;
+        babel::image::write_config config;
+        config.format = "png";
+        if (!babel::image::write([&](cc::span<std::byte const> data) { png.push_back_range(data); }, sheet.image, config))
+            LOG_ERROR("Could not encode contact sheet: {}", sheet.path);
+        else
+            write_file_bytes(sheet.path, png);
+    }
+}
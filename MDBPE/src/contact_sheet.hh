@@ -0,0 +1,67 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <clean-core/span.hh>
+#include <clean-core/string.hh>
+#include <clean-core/vector.hh>
+
+#include <typed-geometry/types/color.hh>
+
+#include <babel-serializer/image/image.hh>
+
+#include "image_data.hh"
+#include "settings.hh"
+
+namespace tp
+{
+/// debug renderer: tiles the class and id planes of a sample of the images into one contact sheet per sampled iteration
+/// every settings.debug_image_stride-th image is drawn (at most settings.debug_max_tiles), every settings.debug_iteration_stride-th iteration
+/// sheets are composed in parallel on the calling thread, PNG encoding and writing happen on a background thread
+/// with settings.debug_image_stride = 0 the renderer does nothing, so it can stay in production runs
+struct contact_sheet_writer
+{
+public:
+    /// sheets are written to {folder}sheet_{iteration:06}.png, classes and ids are drawn with 'colors' (wrapping around)
+    contact_sheet_writer(cc::string folder, cc::span<tg::color3 const> colors, settings const& settings);
+    ~contact_sheet_writer();
+
+    contact_sheet_writer(contact_sheet_writer const&) = delete;
+    contact_sheet_writer& operator=(contact_sheet_writer const&) = delete;
+
+    bool enabled() const { return m_image_stride > 0; }
+
+    /// renders the sheet of an iteration (-1 = the input data) if the iteration is sampled
+    void render(cc::span<image_data const> images, int iteration);
+
+    /// waits until all sheets are written
+    void finish();
+
+private:
+    struct pending_sheet
+    {
+        cc::string path;
+        babel::image::data image;
+    };
+
+    void work();
+
+    cc::string m_folder;
+    cc::vector<std::byte> m_palette; // rgb8 per color
+    int m_image_stride = 0;
+    int m_iteration_stride = 1;
+    int m_max_tiles = 0;
+    int m_upscale = 1;
+
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+    std::deque<pending_sheet> m_queue;
+    bool m_closing = false;
+
+    std::thread m_encoder;
+};
+}
@@ -0,0 +1,78 @@
+#include "decoder.hh"
+
+#include <omp.h>
+
+#include <typed-geometry/tg.hh>
+
+#include <rich-log/log.hh>
+
+tp::decoder::decoder(vocabulary const& vocabulary)
+{
+    m_stamps.resize(vocabulary.tokens.size());
+    for (auto i = 0; i < int(vocabulary.tokens.size()); ++i)
+    {
+        auto const& token = vocabulary.tokens[i];
+        if (token.class_id != i || token.positions.size() != token.position_class.size())
+        {
+            LOG_ERROR("Token {} (class {}) of the vocabulary is out of order or malformed", i, token.class_id);
+            m_stamps.clear();
+            return;
+        }
+
+        m_stamps[i] = {int32_t(m_offsets.size()), int32_t(token.positions.size())};
+        for (size_t p = 0; p < token.positions.size(); ++p)
+        {
+            m_offsets.push_back(tg::ivec2(token.positions[p]));
+            m_classes.push_back(token.position_class[p]);
+        }
+    }
+    m_valid = true;
+}
+
+bool tp::decoder::decode(cc::span<sequence_token const> tokens, int32_t* grid, int width, int height, int32_t fill) const
+{
+    for (auto i = 0; i < width * height; ++i)
+        grid[i] = fill;
+
+    auto const stamp_count = int(m_stamps.size());
+    for (auto const& token : tokens)
+    {
+        if (token.token_class < 0 || token.token_class >= stamp_count)
+            return false;
+
+        auto const& stamp = m_stamps[token.token_class];
+        for (auto p = stamp.first; p < stamp.first + stamp.count; ++p)
+        {
+            auto const q = token.ancor + m_offsets[p];
+            if (q.x < 0 || q.y < 0 || q.x >= width || q.y >= height)
+                continue;
+            grid[q.y * width + q.x] = m_classes[p];
+        }
+    }
+    return true;
+}
+
+bool tp::decode_batch(decoder const& decoder,
+                      cc::span<sequence_token const> tokens,
+                      cc::span<int64_t const> offsets,
+                      int32_t* classes,
+                      int height,
+                      int width,
+                      int32_t fill,
+                      int worker_count)
+{
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+
+    auto const count = int(offsets.size()) - 1;
+    auto const pixel_count = size_t(width) * size_t(height);
+    auto success = true;
+
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 16) reduction(&& : success)
+    for (auto i = 0; i < count; ++i)
+    {
+        auto const sequence = tokens.subspan(offsets[i], offsets[i + 1] - offsets[i]);
+        success = decoder.decode(sequence, classes + size_t(i) * pixel_count, width, height, fill) && success;
+    }
+    return success;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+
+#include <clean-core/span.hh>
+#include <clean-core/vector.hh>
+
+#include <typed-geometry/types/vec.hh>
+
+#include "sequence_codec.hh"
+#include "vocabulary.hh"
+
+namespace tp
+{
+/// reconstructs class grids from token sequences with the token shapes of a loaded vocabulary (see vocabulary.hh)
+/// every token stamps the original classes of its shape at its ancor, clipped at the borders like apply_rule
+/// the decoder is immutable after construction, so any number of threads can decode concurrently
+struct decoder
+{
+public:
+    /// flattens the token shapes into stamps, an inconsistent vocabulary is reported and leaves the decoder invalid
+    explicit decoder(vocabulary const& vocabulary);
+
+    bool valid() const { return m_valid; }
+
+    int token_count() const { return int(m_stamps.size()); }
+
+    /// decodes a sequence into a row-major [height, width] grid, pixels no token covers are set to 'fill'
+    /// returns false if a token class is not in the vocabulary (nothing is reported, the grid is then incomplete)
+    bool decode(cc::span<sequence_token const> tokens, int32_t* grid, int width, int height, int32_t fill = -1) const;
+
+private:
+    struct stamp
+    {
+        int32_t first = 0; // into m_offsets / m_classes
+        int32_t count = 0;
+    };
+
+    cc::vector<stamp> m_stamps; // per token class
+    cc::vector<tg::ivec2> m_offsets;
+    cc::vector<int32_t> m_classes;
+    bool m_valid = false;
+};
+
+/// decodes a ragged batch (the sequence of image i is tokens[offsets[i], offsets[i + 1]), see encoded_batch) into a
+/// contiguous, row-major [offsets.size() - 1, height, width] tensor on 'worker_count' threads (0 = one per core)
+/// returns false if any sequence contains a token class that is not in the vocabulary
+bool decode_batch(decoder const& decoder,
+                  cc::span<sequence_token const> tokens,
+                  cc::span<int64_t const> offsets,
+                  int32_t* classes,
+                  int height,
+                  int width,
+                  int32_t fill = -1,
+                  int worker_count = 0);
+}
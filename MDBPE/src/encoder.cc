@@ -0,0 +1,195 @@
+#include "encoder.hh"
+
+#include <cstring>
+
+#include <omp.h>
+
+#include <clean-core/assert.hh>
+
+#include <typed-geometry/tg.hh>
+
+#include <rich-log/log.hh>
+
+void tp::encoder_workspace::reserve(int pixel_count, int token_count)
+{
+    if (int(token_class.size()) < pixel_count)
+    {
+        token_class.resize(pixel_count);
+        token_id.resize(pixel_count);
+        ancors.resize(2 * size_t(pixel_count)); // every merge adds an ancor, an image has at most pixel_count - 1 merges
+    }
+    if (int(class_count.size()) < token_count)
+        class_count.resize(token_count);
+}
+
+tp::encoder::encoder(vocabulary const& vocabulary) : m_class_count{vocabulary.class_count}, m_token_count{int(vocabulary.tokens.size())}
+{
+    for (auto const& rule : vocabulary.rules)
+    {
+        auto const& c = rule.constellation;
+        auto const in_range = [&](int token) { return token >= 0 && token < m_token_count; };
+        if (!in_range(c.source_class_id) || !in_range(c.target_class_id) || !in_range(rule.new_token_id))
+        {
+            LOG_ERROR("Rule {} -> {} refers to tokens outside of the vocabulary of {} tokens", c.source_class_id, rule.new_token_id, m_token_count);
+            m_rules.clear();
+            return;
+        }
+
+        // same ancor choice as combine_tokens / apply_rule
+        prepared_rule r;
+        r.source_class = c.source_class_id;
+        r.target_class = c.target_class_id;
+        r.ancor_offset = c.ancor_offset;
+        r.new_class = rule.new_token_id;
+        r.keep_source_ancor = !(c.ancor_offset.y < 0 || (c.ancor_offset.y == 0 && c.ancor_offset.x < 0));
+        r.first_position = int32_t(m_positions.size());
+        for (auto const p : vocabulary.tokens[rule.new_token_id].positions)
+            m_positions.push_back(tg::ivec2(p));
+        r.position_count = int32_t(m_positions.size()) - r.first_position;
+        m_rules.push_back(r);
+    }
+    m_valid = true;
+}
+
+int tp::encoder::encode(class_grid_view grid, cc::span<sequence_token> tokens, encoder_workspace& workspace) const
+{
+    auto const width = grid.width;
+    auto const height = grid.height;
+    auto const pixel_count = width * height;
+    if (!m_valid || width <= 0 || height <= 0)
+        return -1;
+
+    workspace.reserve(pixel_count, m_token_count);
+    auto* const token_class = workspace.token_class.data();
+    auto* const token_id = workspace.token_id.data();
+    auto* const ancors = workspace.ancors.data();
+    auto* const class_count = workspace.class_count.data();
+    for (auto i = 0; i < m_token_count; ++i)
+        class_count[i] = 0;
+
+    // every pixel starts as its own token
+    for (auto y = 0; y < height; ++y)
+        for (auto x = 0; x < width; ++x)
+        {
+            auto const c = grid(x, y);
+            if (c < 0 || c >= m_class_count)
+                return -1;
+            auto const i = y * width + x;
+            token_class[i] = c;
+            token_id[i] = i;
+            ancors[i] = {x, y};
+            ++class_count[c];
+        }
+    auto next_id = pixel_count;
+
+    // the same single raster pass per rule as apply_rule, but rules whose classes do not occur are skipped
+    for (auto const& rule : m_rules)
+    {
+        if (class_count[rule.source_class] == 0 || class_count[rule.target_class] == 0)
+            continue;
+
+        for (auto y = 0; y < height; ++y)
+            for (auto x = 0; x < width; ++x)
+            {
+                auto const i = y * width + x;
+                if (token_class[i] != rule.source_class || ancors[token_id[i]] != tg::ipos2(x, y))
+                    continue;
+
+                auto const other = tg::ipos2(x, y) + rule.ancor_offset;
+                if (other.x < 0 || other.y < 0 || other.x >= width || other.y >= height)
+                    continue;
+                auto const j = other.y * width + other.x;
+                if (token_class[j] != rule.target_class || ancors[token_id[j]] != other)
+                    continue;
+
+                auto const new_ancor = rule.keep_source_ancor ? tg::ipos2(x, y) : other;
+                auto const new_id = next_id++;
+                ancors[new_id] = new_ancor;
+                for (auto p = 0; p < rule.position_count; ++p)
+                {
+                    auto const q = new_ancor + m_positions[rule.first_position + p];
+                    if (q.x < 0 || q.y < 0 || q.x >= width || q.y >= height)
+                        continue;
+                    token_class[q.y * width + q.x] = rule.new_class;
+                    token_id[q.y * width + q.x] = new_id;
+                }
+                --class_count[rule.source_class];
+                --class_count[rule.target_class];
+                ++class_count[rule.new_class];
+            }
+    }
+
+    // a token is emitted at its ancor, which is its first pixel in raster order
+    auto length = 0;
+    for (auto y = 0; y < height; ++y)
+        for (auto x = 0; x < width; ++x)
+        {
+            auto const i = y * width + x;
+            if (ancors[token_id[i]] != tg::ipos2(x, y))
+                continue;
+            if (length >= int(tokens.size()))
+                return -1;
+            tokens[length++] = {token_class[i], {x, y}};
+        }
+    return length;
+}
+
+int tp::encode_batch(encoder const& encoder,
+                    int32_t const* classes,
+                    int count,
+                    int height,
+                    int width,
+                    cc::span<sequence_token> tokens,
+                    cc::span<int64_t> offsets,
+                    cc::vector<encoder_workspace>& workspaces,
+                    int worker_count)
+{
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+
+    // a sequence has at most one token per pixel
+    auto const pixel_count = size_t(width) * size_t(height);
+    CC_ASSERT(tokens.size() >= size_t(count) * pixel_count && "one slot of width * height tokens per image");
+    CC_ASSERT(offsets.size() >= size_t(count) + 1);
+    if (int(workspaces.size()) < worker_count)
+        workspaces.resize(worker_count);
+
+    // lengths go into offsets[i + 1] first and are turned into offsets afterwards
+    auto first_invalid = count;
+#pragma omp parallel num_threads(worker_count) reduction(min : first_invalid)
+    {
+        auto& workspace = workspaces[omp_get_thread_num()];
+#pragma omp for schedule(dynamic, 16)
+        for (auto i = 0; i < count; ++i)
+        {
+            auto const grid = class_grid_view{classes + size_t(i) * pixel_count, width, height, 0};
+            auto const slot = tokens.subspan(size_t(i) * pixel_count, pixel_count);
+            auto const length = encoder.encode(grid, slot, workspace);
+            if (length < 0)
+                first_invalid = tg::min(first_invalid, i);
+            offsets[i + 1] = tg::max(length, 0);
+        }
+    }
+
+    // compaction: a sequence only moves towards the front, so moving them in order never overwrites one that is still needed
+    offsets[0] = 0;
+    for (auto i = 0; i < count; ++i)
+    {
+        auto const length = offsets[i + 1];
+        auto const begin = offsets[i];
+        if (length > 0 && size_t(begin) != size_t(i) * pixel_count)
+            std::memmove(tokens.data() + begin, tokens.data() + size_t(i) * pixel_count, size_t(length) * sizeof(sequence_token));
+        offsets[i + 1] = begin + length;
+    }
+
+    return first_invalid < count ? first_invalid : -1;
+}
+
+bool tp::encode_batch(encoder const& encoder, int32_t const* classes, int count, int height, int width, encoded_batch& batch, int worker_count)
+{
+    batch.tokens.resize(size_t(count) * size_t(width) * size_t(height));
+    batch.offsets.resize(size_t(count) + 1);
+    batch.first_invalid = encode_batch(encoder, classes, count, height, width, batch.tokens, batch.offsets, batch.workspaces, worker_count);
+    batch.tokens.resize(size_t(batch.offsets[count]));
+    return batch.first_invalid < 0;
+}
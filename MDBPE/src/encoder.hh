@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <clean-core/span.hh>
+#include <clean-core/vector.hh>
+
+#include <typed-geometry/types/pos.hh>
+#include <typed-geometry/types/vec.hh>
+
+#include "sequence_codec.hh"
+#include "vocabulary.hh"
+
+namespace tp
+{
+/// a row-major grid of initial classes owned by the caller
+struct class_grid_view
+{
+    int32_t const* data = nullptr;
+    int width = 0;
+    int height = 0;
+    ptrdiff_t row_stride = 0; // elements between the starts of two rows; 0 = width
+
+    int32_t operator()(int x, int y) const { return data[y * (row_stride > 0 ? row_stride : width) + x]; }
+};
+
+/// scratch memory of the encoder, one per thread
+/// the buffers grow to the largest image encoded with it and are reused, so encoding allocates nothing once they are large enough
+struct encoder_workspace
+{
+    cc::vector<int32_t> token_class; // current class per pixel
+    cc::vector<int32_t> token_id;    // current token id per pixel
+    cc::vector<tg::ipos2> ancors;    // ancor per token id
+    cc::vector<int32_t> class_count; // tokens per class, rules without both classes are skipped
+
+    /// grows the buffers for images with up to 'pixel_count' pixels and a vocabulary with 'token_count' tokens
+    void reserve(int pixel_count, int token_count);
+};
+
+/// encodes class grids into token sequences in memory, with the rules of a loaded vocabulary (see vocabulary.hh)
+/// the result is identical to apply_rules + extract_token_sequence, but without image_data, files or logging
+/// the encoder is immutable after construction, so any number of threads can encode concurrently, each with its own workspace
+struct encoder
+{
+public:
+    /// prepares the rules of the vocabulary, an inconsistent vocabulary is reported and leaves the encoder invalid
+    explicit encoder(vocabulary const& vocabulary);
+
+    bool valid() const { return m_valid; }
+
+    int class_count() const { return m_class_count; }
+    int token_count() const { return m_token_count; }
+
+    /// encodes a grid into 'tokens' (raster order of the ancors) and returns the token count
+    /// a sequence has at most width * height tokens. returns -1 if 'tokens' is too small or the grid contains classes
+    /// outside of [0, class_count()); nothing is reported, so this is safe to call from data loader threads
+    int encode(class_grid_view grid, cc::span<sequence_token> tokens, encoder_workspace& workspace) const;
+
+private:
+    /// a rule with the shape of its new token, relative to the new ancor
+    struct prepared_rule
+    {
+        int32_t source_class = 0;
+        int32_t target_class = 0;
+        tg::ivec2 ancor_offset;
+        int32_t new_class = 0;
+        bool keep_source_ancor = true;
+        int32_t first_position = 0; // into m_positions
+        int32_t position_count = 0;
+    };
+
+    cc::vector<prepared_rule> m_rules;
+    cc::vector<tg::ivec2> m_positions;
+    int m_class_count = 0;
+    int m_token_count = 0;
+    bool m_valid = false;
+};
+
+/// ragged token sequences of a batch: the tokens of image i are tokens[offsets[i], offsets[i + 1])
+/// reusing the same batch for the next call reuses all of its memory
+struct encoded_batch
+{
+    cc::vector<sequence_token> tokens; // all sequences, one after the other
+    cc::vector<int64_t> offsets;       // image count + 1 entries
+    int first_invalid = -1;            // first image with classes outside of the vocabulary, -1 if all are valid
+
+    cc::vector<encoder_workspace> workspaces; // one per thread
+};
+
+/// encodes a contiguous, row-major [count, height, width] class tensor on 'worker_count' threads (0 = one per core)
+/// every image is encoded into its own slot of the token array, then the slots are compacted into the ragged layout
+/// returns false if an image contains invalid classes (see encoded_batch::first_invalid), its sequence is left empty
+bool encode_batch(encoder const& encoder, int32_t const* classes, int count, int height, int width, encoded_batch& batch, int worker_count = 0);
+
+/// same as above, but into caller-owned memory, e.g. the buffers of numpy arrays
+/// 'tokens' needs room for count * height * width tokens (one slot per image), 'offsets' for count + 1 entries
+/// 'workspaces' is grown to one per thread. returns the first image with invalid classes (its sequence is left empty), -1 if all are valid
+int encode_batch(encoder const& encoder,
+                 int32_t const* classes,
+                 int count,
+                 int height,
+                 int width,
+                 cc::span<sequence_token> tokens,
+                 cc::span<int64_t> offsets,
+                 cc::vector<encoder_workspace>& workspaces,
+                 int worker_count = 0);
+}
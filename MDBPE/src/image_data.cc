@@ -1 +1,155 @@
 #include "image_data.hh"
+
+#include <bit>
+#include <cstring>
+
+#include <babel-serializer/compression/lz4.hh>
+
+#include "util.hh"
+
+namespace
+{
+template <class T>
+cc::span<std::byte const> as_bytes(T const* data, size_t count)
+{
+    return {reinterpret_cast<std::byte const*>(data), count * sizeof(T)};
+}
+
+template <class T>
+cc::span<std::byte> as_writable_bytes(T* data, size_t count)
+{
+    return {reinterpret_cast<std::byte*>(data), count * sizeof(T)};
+}
+}
+
+void tp::image_data::compress(cc::vector<counted_constellation> constellations)
+{
+    if (is_compressed())
+        return;
+    decompress(); // mapped images are read first
+
+    // class summary
+    m_class_summary.clear();
+    current_token_class.for_each(
+        [&](int c)
+        {
+            if (c < 0) // never a rule class (see has_class)
+                return;
+            auto const word = size_t(c) / 64;
+            if (word >= m_class_summary.size())
+                m_class_summary.resize(word + 1, 0);
+            m_class_summary[word] |= uint64_t(1) << (c % 64);
+        });
+
+    // one lz4 block per plane, so that decompression can go straight into the planes
+    auto const pixels = m_initial_token_class.data_size();
+    cc::span<std::byte const> const blocks[4] = {
+        as_bytes(m_initial_token_class.data_ptr(), pixels),
+        as_bytes(current_token_class.data_ptr(), pixels),
+        as_bytes(current_token_id.data_ptr(), pixels),
+        as_bytes(token_ancor.data(), token_ancor.size()),
+    };
+    for (auto i = 0; i < 4; ++i)
+    {
+        auto const block = babel::lz4::compress(blocks[i]);
+        m_block_sizes[i] = block.size();
+        m_compressed.push_back_range(block);
+    }
+    m_compressed.shrink_to_fit();
+    m_stored_extents = m_initial_token_class.extents();
+    m_compressed_ancor_count = token_ancor.size();
+    m_constellations = cc::move(constellations);
+
+    // release the planes
+    m_initial_token_class = {};
+    current_token_class = {};
+    current_token_id = {};
+    token_ancor = {};
+}
+
+void tp::image_data::decompress()
+{
+    if (is_resident())
+        return;
+
+    image_data restored;
+    decompressed(restored);
+
+    m_initial_token_class = cc::move(restored.m_initial_token_class);
+    current_token_class = cc::move(restored.current_token_class);
+    current_token_id = cc::move(restored.current_token_id);
+    token_ancor = cc::move(restored.token_ancor);
+    m_next_token_id = restored.m_next_token_id;
+
+    m_compressed = {};
+    m_class_summary = {};
+    m_compressed_ancor_count = 0;
+    m_constellations = {};
+    m_mapping = {};
+    m_mapped_plane = nullptr;
+    m_mapped_class_bytes = 0;
+    m_mapped_signed = false;
+}
+
+tp::image_data const& tp::image_data::decompressed(image_data& scratch) const
+{
+    if (is_resident())
+        return *this;
+
+    CC_ASSERT(&scratch != this && "use decompress() instead");
+
+    scratch.filename = filename;
+    scratch.id = id;
+    scratch.m_initial_token_class.resize(m_stored_extents);
+
+    if (is_mapped())
+    {
+        // untouched image: widen the mapped plane, everything else is the initial state
+        auto plane = scratch.m_initial_token_class.data_ptr();
+        auto const pixels = scratch.m_initial_token_class.data_size();
+        if (m_mapped_class_bytes == 1)
+        {
+            auto const src = reinterpret_cast<uint8_t const*>(m_mapped_plane);
+            for (size_t i = 0; i < pixels; ++i)
+                plane[i] = m_mapped_signed ? int(int8_t(src[i])) : int(src[i]);
+        }
+        else if (m_mapped_class_bytes == 2)
+        {
+            auto const src = reinterpret_cast<uint8_t const*>(m_mapped_plane);
+            for (size_t i = 0; i < pixels; ++i)
+            {
+                auto const v = uint16_t(src[2 * i] | src[2 * i + 1] << 8);
+                plane[i] = m_mapped_signed ? int(int16_t(v)) : int(v);
+            }
+        }
+        else
+        {
+            std::memcpy(plane, m_mapped_plane, pixels * sizeof(int));
+            if constexpr (std::endian::native == std::endian::big)
+                for (size_t i = 0; i < pixels; ++i)
+                    plane[i] = byteswap(plane[i]);
+        }
+        scratch.init_from_initial_token_class();
+        return scratch;
+    }
+
+    scratch.m_next_token_id = m_next_token_id;
+    scratch.current_token_class.resize(m_stored_extents);
+    scratch.current_token_id.resize(m_stored_extents);
+    scratch.token_ancor.resize(m_compressed_ancor_count);
+
+    auto const pixels = scratch.m_initial_token_class.data_size();
+    cc::span<std::byte> const blocks[4] = {
+        as_writable_bytes(scratch.m_initial_token_class.data_ptr(), pixels),
+        as_writable_bytes(scratch.current_token_class.data_ptr(), pixels),
+        as_writable_bytes(scratch.current_token_id.data_ptr(), pixels),
+        as_writable_bytes(scratch.token_ancor.data(), scratch.token_ancor.size()),
+    };
+    size_t offset = 0;
+    for (auto i = 0; i < 4; ++i)
+    {
+        babel::lz4::uncompress_to(blocks[i], cc::span(m_compressed).subspan(offset, m_block_sizes[i]));
+        offset += m_block_sizes[i];
+    }
+    return scratch;
+}
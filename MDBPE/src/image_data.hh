@@ -1,10 +1,18 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <clean-core/span.hh>
 #include <clean-core/string.hh>
 #include <clean-core/string_view.hh>
+#include <clean-core/vector.hh>
 
 #include <image/image.hh>
 
+#include "constellation.hh"
+
 namespace tp
 {
 /// image data for a single image
@@ -20,18 +28,27 @@ public:
     image_data(cc::string_view filename, int id, img::image<int> token_class)
       : filename{filename}, id{id}, m_initial_token_class{cc::move(token_class)}
     {
-        current_token_class = m_initial_token_class; // copy initial classes
+        init_from_initial_token_class();
+    }
 
-        // initialize current_token_id and ancor with the pixel position
-        auto const width = m_initial_token_class.width();
-        auto const height = m_initial_token_class.height();
-        current_token_id.resize({width, height});
-        for (auto y = 0; y < height; ++y)
-            for (auto x = 0; x < width; ++x)
-            {
-                current_token_id(x, y) = next_token_id();
-                token_ancor.push_back({x, y});
-            }
+    /// image backed by a class plane inside a memory-mapped file (little-endian, 'class_bytes' = 1, 2 or 4 bytes per class)
+    /// the plane is only read when the image is used for the first time, 'mapping' keeps the file mapped until then
+    /// 'is_signed' planes are sign-extended, the caller has to make sure they contain no negative classes
+    image_data(cc::string_view filename,
+               int id,
+               tg::isize2 extents,
+               std::byte const* plane,
+               int class_bytes,
+               std::shared_ptr<void const> mapping,
+               bool is_signed = false)
+      : filename{filename},
+        id{id},
+        m_mapping{cc::move(mapping)},
+        m_mapped_plane{plane},
+        m_mapped_class_bytes{class_bytes},
+        m_mapped_signed{is_signed},
+        m_stored_extents{extents}
+    {
     }
 
     cc::string filename;                 // input filename
@@ -46,8 +63,79 @@ public:
 
     img::image<int> const& initial_token_class() const { return m_initial_token_class; }
 
+    // ----- non-resident storage: compressed inactive images and memory-mapped images -----
+
+    /// lz4-compresses all planes and the ancors and releases them, keeps a class summary for might_contain
+    /// 'constellations' are the constellation counts of the image (see get_most_common_constellation), kept until it is decompressed
+    void compress(cc::vector<counted_constellation> constellations);
+
+    /// makes the planes resident (decompresses or reads the mapped plane), no-op if they already are
+    void decompress();
+
+    /// returns this image if it is resident, otherwise decompresses it into 'scratch' and returns that
+    /// 'scratch' keeps its buffers between calls, so reusing it avoids allocations
+    image_data const& decompressed(image_data& scratch) const;
+
+    /// constellation counts passed to compress, valid while the image is compressed
+    cc::span<counted_constellation const> cached_constellations() const { return m_constellations; }
+
+    bool is_compressed() const { return !m_compressed.empty(); }
+    bool is_mapped() const { return m_mapped_plane != nullptr; }
+    bool is_resident() const { return !is_compressed() && !is_mapped(); }
+
+    /// extents of the image, also valid if it is not resident
+    tg::isize2 extents() const { return is_resident() ? m_initial_token_class.extents() : m_stored_extents; }
+
+    /// cheap conservative test whether a rule on the two classes might apply to this image
+    /// exact for compressed images (class summary), always true otherwise
+    bool might_contain(int class_a, int class_b) const
+    {
+        if (!is_compressed())
+            return true;
+        return has_class(class_a) && has_class(class_b);
+    }
+
 private:
+    void init_from_initial_token_class()
+    {
+        current_token_class = m_initial_token_class; // copy initial classes
+
+        // initialize current_token_id and ancor with the pixel position
+        auto const width = m_initial_token_class.width();
+        auto const height = m_initial_token_class.height();
+        current_token_id.resize({width, height});
+        token_ancor.clear();
+        m_next_token_id = 0;
+        for (auto y = 0; y < height; ++y)
+            for (auto x = 0; x < width; ++x)
+            {
+                current_token_id(x, y) = next_token_id();
+                token_ancor.push_back({x, y});
+            }
+    }
+
+    bool has_class(int class_id) const
+    {
+        auto const word = size_t(class_id) / 64;
+        return class_id >= 0 && word < m_class_summary.size() && (m_class_summary[word] >> (class_id % 64)) & 1;
+    }
+
     img::image<int> m_initial_token_class; // never change after initial creation!
     int m_next_token_id = 0;
+
+    // only set while compressed
+    cc::vector<std::byte> m_compressed;   // lz4 blocks of the initial class, current class and current id planes and the ancors
+    size_t m_block_sizes[4] = {};         // compressed size of each block
+    cc::vector<uint64_t> m_class_summary; // bit c is set iff class c occurs in current_token_class
+    size_t m_compressed_ancor_count = 0;  // size of token_ancor
+    cc::vector<counted_constellation> m_constellations; // constellation counts, so counting does not need the planes
+
+    // only set while mapped
+    std::shared_ptr<void const> m_mapping;     // keeps the mapped file alive
+    std::byte const* m_mapped_plane = nullptr; // initial classes inside the mapping
+    int m_mapped_class_bytes = 0;              // bytes per class in the mapped plane
+    bool m_mapped_signed = false;              // the mapped classes are two's complement
+
+    tg::isize2 m_stored_extents; // extents of the planes while not resident
 };
 }
@@ -1,11 +1,21 @@
 #include "io.hh"
 
+#include <bit>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
+#include <string_view>
 
+#include <omp.h>
+
+#include <clean-core/array.hh>
 #include <clean-core/from_string.hh>
 #include <clean-core/set.hh>
 #include <clean-core/vector.hh>
 
+#include <typed-geometry/tg.hh>
+
 #include <babel-serializer/data/byte_reader.hh>
 #include <babel-serializer/data/byte_writer.hh>
 #include <babel-serializer/file.hh>
@@ -15,16 +25,37 @@
 
 #include <rich-log/log.hh>
 
+#include "async_io.hh"
+#include "raster.hh"
 #include "rule.hh"
+#include "sequence_codec.hh"
+#include "sequence_writer.hh"
+#include "shard.hh"
+#include "tar.hh"
+#include "tensor_io.hh"
 #include "util.hh"
 
-img::image<int> tp::read_token_bin_data(cc::string_view filepath)
+namespace
 {
-    auto const data = babel::file::read_all_bytes(filepath);
+// files at least this large are memory-mapped instead of read into a buffer
+constexpr size_t mmap_threshold_bytes = size_t(1) << 20;
 
+// per-pixel reader path, only used to diagnose malformed files
+img::image<int> parse_token_bin_data_checked(cc::span<std::byte const> data, cc::string_view source)
+{
     babel::experimental::byte_reader reader(data);
-    auto const width = reader.read_i32();
-    auto const height = reader.read_i32();
+    int width = 0;
+    int height = 0;
+    if (!reader.read_i32(width) || !reader.read_i32(height))
+    {
+        LOG_ERROR("File is too small for a .dat header ({} bytes): {}", data.size(), source);
+        return {};
+    }
+    if (width <= 0 || height <= 0)
+    {
+        LOG_ERROR("Invalid image size {}x{}: {}", width, height, source);
+        return {};
+    }
 
     img::image<int> image(width, height);
 
@@ -32,13 +63,91 @@ img::image<int> tp::read_token_bin_data(cc::string_view filepath)
     {
         for (int x = 0; x < width; ++x)
         {
-            image(x, y) = reader.read_i32();
+            if (!reader.read_i32(image(x, y)))
+            {
+                LOG_ERROR("File is truncated at pixel ({}, {}) of {}x{}: {}", x, y, width, height, source);
+                return {};
+            }
         }
     }
+
+    if (reader.has_remaining_bytes())
+        LOG_WARN("Ignoring {} trailing bytes: {}", data.size() - 8 - 4 * size_t(width) * size_t(height), source);
+
     return image;
 }
+}
+
+img::image<int> tp::parse_token_bin_data(cc::span<std::byte const> data, cc::string_view source)
+{
+    // fast path: validate header and size once, then bulk-copy the little-endian int32 payload
+    int32_t header[2] = {};
+    if (data.size() >= sizeof(header))
+    {
+        std::memcpy(header, data.data(), sizeof(header));
+        if constexpr (std::endian::native == std::endian::big)
+        {
+            header[0] = byteswap(header[0]);
+            header[1] = byteswap(header[1]);
+        }
+    }
+    auto const width = header[0];
+    auto const height = header[1];
+    auto const pixel_count = size_t(tg::max(0, width)) * size_t(tg::max(0, height));
+
+    if (width <= 0 || height <= 0 || data.size() != sizeof(header) + pixel_count * sizeof(int32_t))
+        return parse_token_bin_data_checked(data, source);
+
+    static_assert(sizeof(int) == sizeof(int32_t), "class images are stored as int32");
+    img::image<int> image(width, height);
+    std::memcpy(image.data_ptr(), data.data() + sizeof(header), pixel_count * sizeof(int32_t));
+    if constexpr (std::endian::native == std::endian::big)
+        image.for_each([](int& v) { v = byteswap(v); });
+
+    return image;
+}
+
+img::image<int> tp::read_token_bin_data(cc::string_view filepath)
+{
+    if (babel::file::size_of(filepath) >= mmap_threshold_bytes)
+    {
+        auto const mapped_file = babel::file::make_memory_mapped_file_readonly(filepath);
+        return parse_token_bin_data(cc::span<std::byte const>(mapped_file.data(), mapped_file.size()), filepath);
+    }
+
+    auto const data = babel::file::read_all_bytes(filepath);
+    return parse_token_bin_data(data, filepath);
+}
+
+cc::string_view tp::strip_extension(cc::string_view filename)
+{
+    auto const name = std::string_view(filename.data(), filename.size());
+    auto const dot = name.rfind('.');
+    auto const slash = name.rfind('/');
+    if (dot == std::string_view::npos || (slash != std::string_view::npos && dot < slash))
+        return filename;
+    return filename.subview(0, dot);
+}
+
+bool tp::parse_image_id(cc::string_view stem, int& id)
+{
+    auto const filename_parts = cc::vector<cc::string_view>(stem.split('_'));
+    if (filename_parts.size() == 1)
+        return cc::from_string(filename_parts[0], id);
+    if (filename_parts.size() == 2)
+        return cc::from_string(filename_parts[1], id);
+    return false;
+}
 
-cc::vector<tp::image_data> tp::read_folder(cc::string_view folder)
+cc::span<cc::string_view const> tp::input_extensions()
+{
+    static cc::string_view const extensions[] = {".dat"};
+    return extensions;
+}
+
+cc::vector<tp::input_file> tp::list_input_files(cc::string_view folder) { return list_input_files(folder, input_extensions()); }
+
+cc::vector<tp::input_file> tp::list_input_files(cc::string_view folder, cc::span<cc::string_view const> extensions)
 {
     auto const path = std::filesystem::path(folder.begin(), folder.end());
 
@@ -48,7 +157,7 @@ cc::vector<tp::image_data> tp::read_folder(cc::string_view folder)
         return {};
     }
 
-    cc::vector<image_data> images;
+    cc::vector<input_file> files;
 
     for (auto const& entry : std::filesystem::recursive_directory_iterator(path))
     {
@@ -61,45 +170,273 @@ cc::vector<tp::image_data> tp::read_folder(cc::string_view folder)
             continue;
         }
 
-        if (entry.path().extension() != ".dat")
+        auto const extension = cc::string(entry.path().extension().string());
+        auto accepted = false;
+        for (auto const& e : extensions)
+            accepted = accepted || cc::string_view(extension) == e;
+        if (!accepted)
         {
-            LOG_WARN("Skipping non-.dat file: {}", entry.path().string());
+            LOG_WARN("Skipping file with unexpected extension: {}", entry.path().string());
             continue;
         }
 
-        auto const filename = cc::string(entry.path().filename().string());
         auto const stem = cc::string(entry.path().stem().string());
 
-        auto const filename_parts = cc::vector<cc::string_view>(stem.split('_'));
         int id = -1;
-        if (filename_parts.size() == 1)
+        if (!parse_image_id(stem, id))
         {
-            if (!cc::from_string(filename_parts[0], id))
-            {
-                LOG_WARN("File does not have the expected file-format: {}", entry.path().string());
+            LOG_WARN("File does not have the expected file-format: {}", entry.path().string());
+            continue;
+        }
+
+        input_file file;
+        file.path = cc::string(entry.path().string());
+        file.filename = cc::string(entry.path().filename().string());
+        file.id = id;
+        file.size = size_t(entry.file_size());
+        files.push_back(cc::move(file));
+    }
+
+    // directory iteration order is filesystem dependent, the image order should not be
+    cc::sort(files, [](auto const& a, auto const& b) { return std::string_view(a.path.c_str()) < std::string_view(b.path.c_str()); });
+
+    return files;
+}
+
+bool tp::read_file_bytes(cc::string_view filepath, size_t offset, size_t length, cc::vector<std::byte>& data)
+{
+    auto const file = std::fopen(cc::string(filepath).c_str(), "rb");
+    if (!file)
+    {
+        LOG_ERROR("Could not open input file: {}", filepath);
+        return false;
+    }
+
+    // the range is checked against the file size, a bad manifest entry must not turn into a huge allocation
+    auto const end = seek_file(file, 0, SEEK_END) ? tell_file(file) : int64_t(-1);
+    if (end < 0)
+    {
+        std::fclose(file);
+        LOG_ERROR("Could not determine the size of input file: {}", filepath);
+        return false;
+    }
+    auto const file_size = size_t(end);
+    if (offset > file_size || length > file_size - offset)
+    {
+        std::fclose(file);
+        LOG_ERROR("Range of {} bytes at offset {} exceeds the file size of {} bytes: {}", length, offset, file_size, filepath);
+        return false;
+    }
+
+    if (length == 0)
+        length = file_size - offset;
+    data.resize(length);
+
+    auto const success = seek_file(file, int64_t(offset)) && std::fread(data.data(), 1, length, file) == length;
+    std::fclose(file);
+
+    if (!success)
+        LOG_ERROR("Could not read {} bytes at offset {}: {}", length, offset, filepath);
+    return success;
+}
+
+bool tp::write_file_bytes(cc::string_view filepath, cc::span<std::byte const> data)
+{
+    auto const file = std::fopen(cc::string(filepath).c_str(), "wb");
+    if (!file)
+    {
+        LOG_ERROR("Could not open output file: {}", filepath);
+        return false;
+    }
+
+    auto const written = std::fwrite(data.data(), 1, data.size(), file);
+    auto const closed = std::fclose(file) == 0;
+
+    if (written != data.size() || !closed)
+    {
+        LOG_ERROR("Could not write {} bytes: {}", data.size(), filepath);
+        return false;
+    }
+    return true;
+}
+
+int tp::read_batch_size(int worker_count, int io_depth)
+{
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+    if (io_depth <= 0)
+        io_depth = worker_count;
+    return tg::max(1, io_depth * 64);
+}
+
+cc::vector<tp::image_data> tp::read_input_files(cc::span<input_file const> files, int worker_count, int io_depth, io_backend backend)
+{
+    auto const file_count = int(files.size());
+
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+    if (io_depth <= 0)
+        io_depth = worker_count;
+
+    // pre-sized, every file has its fixed slot
+    cc::vector<image_data> images;
+    images.resize(file_count);
+
+    // large files are not read here but memory-mapped by read_token_bin_data instead
+    auto const is_mapped = [](input_file const& file) { return file.length == 0 && file.size >= mmap_threshold_bytes; };
+
+    // files are processed in batches: up to 'io_depth' reads are in flight (see io_queue), then 'worker_count' threads parse them
+    // this keeps at most one batch of raw file data in memory
+    auto const batch_size = read_batch_size(worker_count, io_depth);
+    io_queue queue(io_depth, backend);
+    cc::vector<read_request> requests;
+    cc::vector<int> request_index; // request of each file in the batch, -1 for mapped files
+    request_index.resize(batch_size);
+
+    for (auto batch_begin = 0; batch_begin < file_count; batch_begin += batch_size)
+    {
+        auto const batch_end = tg::min(file_count, batch_begin + batch_size);
+
+        requests.clear();
+        for (auto i = batch_begin; i < batch_end; ++i)
+        {
+            request_index[i - batch_begin] = -1;
+            if (is_mapped(files[i]))
                 continue;
-            }
+
+            request_index[i - batch_begin] = int(requests.size());
+            auto& request = requests.emplace_back();
+            request.path = files[i].path;
+            request.offset = files[i].offset;
+            request.length = files[i].length;
         }
-        else if (filename_parts.size() == 2)
+        queue.read(requests); // failed reads are reported and left empty
+
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 4)
+        for (auto i = batch_begin; i < batch_end; ++i)
         {
-            if (!cc::from_string(filename_parts[1], id))
-            {
-                LOG_WARN("File does not have the expected file-format: {}", entry.path().string());
+            auto const& file = files[i];
+            auto const r = request_index[i - batch_begin];
+            if (r >= 0 && !requests[r].ok)
                 continue;
-            }
+
+            auto image = r < 0 ? read_token_bin_data(file.path) : parse_token_bin_data(requests[r].data, file.path);
+            if (image.pixel_count() > 0)
+                images[i] = image_data(file.filename, file.id, cc::move(image));
+            if (r >= 0)
+                requests[r].data = {};
         }
-        else
+    }
+
+    remove_empty_images(images); // unreadable and malformed files are already reported
+    return images;
+}
+
+cc::vector<tp::image_data> tp::read_folder(cc::string_view folder, int worker_count, int io_depth, io_backend backend)
+{
+    auto const files = list_input_files(folder);
+    return read_input_files(files, worker_count, io_depth, backend);
+}
+
+void tp::remove_empty_images(cc::vector<image_data>& images)
+{
+    auto valid_count = 0;
+    for (auto i = 0; i < int(images.size()); ++i)
+        if (images[i].extents() != tg::isize2(0, 0))
         {
-            LOG_WARN("File does not have the expected file-format: {}", entry.path().string());
-            continue;
+            if (valid_count != i)
+                images[valid_count] = cc::move(images[i]);
+            ++valid_count;
         }
+    images.resize(valid_count);
+}
+
+bool tp::is_shard_input(cc::string_view input) { return input.ends_with(".shard"); }
+
+bool tp::is_manifest_input(cc::string_view input) { return input.ends_with(".manifest"); }
+
+cc::vector<tp::input_file> tp::read_manifest(cc::string_view manifest_file)
+{
+    cc::vector<std::byte> data;
+    if (!read_file_bytes(manifest_file, 0, 0, data))
+        return {};
+
+    auto const text = std::string_view(reinterpret_cast<char const*>(data.data()), data.size());
+    auto const base_dir = std::filesystem::path(manifest_file.begin(), manifest_file.end()).parent_path();
 
-        auto image = read_token_bin_data(entry.path().string());
+    cc::vector<input_file> files;
+    auto line_number = 0;
+    size_t line_begin = 0;
+    while (line_begin < text.size())
+    {
+        auto line_end = text.find('\n', line_begin);
+        if (line_end == std::string_view::npos)
+            line_end = text.size();
+        auto line = text.substr(line_begin, line_end - line_begin);
+        line_begin = line_end + 1;
+        ++line_number;
+
+        if (auto const comment = line.find('#'); comment != std::string_view::npos)
+            line = line.substr(0, comment);
+
+        // split at whitespace
+        cc::vector<std::string_view> fields;
+        size_t pos = 0;
+        while (true)
+        {
+            pos = line.find_first_not_of(" \t\r", pos);
+            if (pos == std::string_view::npos)
+                break;
+            auto const end = tg::min(line.find_first_of(" \t\r", pos), line.size());
+            fields.push_back(line.substr(pos, end - pos));
+            pos = end;
+        }
 
-        images.push_back({filename, id, image});
+        if (fields.empty())
+            continue;
+
+        input_file file;
+        auto valid = fields.size() == 2 || fields.size() == 4;
+        valid = valid && cc::from_string(cc::string_view(fields[1].data(), fields[1].size()), file.id);
+        if (valid && fields.size() == 4)
+        {
+            valid = cc::from_string(cc::string_view(fields[2].data(), fields[2].size()), file.offset)
+                    && cc::from_string(cc::string_view(fields[3].data(), fields[3].size()), file.length) && file.length > 0;
+        }
+        if (!valid)
+        {
+            LOG_ERROR("Malformed manifest line {} in {}, expected \"<path> <id> [<offset> <length>]\"", line_number, manifest_file);
+            continue;
+        }
+
+        auto path = std::filesystem::path(fields[0]);
+        if (path.is_relative())
+            path = base_dir / path;
+        file.path = cc::string(path.string());
+        file.filename = cc::string(path.filename().string());
+        files.push_back(cc::move(file));
     }
 
-    return images;
+    return files;
+}
+
+cc::vector<tp::image_data> tp::read_input(cc::string_view input, settings const& settings, int class_count)
+{
+    if (settings.raster_input != raster_mode::none)
+        return read_raster_folder(
+            input, settings.raster_input, class_count, settings.raster_palette, settings.read_worker_count, settings.read_io_depth, settings.io);
+    if (is_manifest_input(input))
+        return read_input_files(read_manifest(input), settings.read_worker_count, settings.read_io_depth, settings.io);
+    if (is_shard_input(input))
+        return read_shard(input);
+    if (is_npy_input(input))
+        return read_npy(input, settings.map_tensor_inputs, class_count);
+    if (is_idx_input(input))
+        return read_idx(input, settings.map_tensor_inputs, class_count);
+    if (is_tar_input(input))
+        return read_tar(expand_shard_pattern(input), settings.read_worker_count);
+
+    return read_folder(input, settings.read_worker_count, settings.read_io_depth, settings.io);
 }
 
 void tp::write(cc::string_view filepath, img::image<int> const& image, cc::span<tg::color3 const> colors)
@@ -133,8 +470,11 @@ void tp::write(cc::string_view filepath, img::image<int> const& image, int max_c
 
 void tp::write_images(cc::span<image_data const> images, cc::string_view folder, int iteration, int output_folder_count, cc::span<tg::color3 const> class_color)
 {
-    for (auto const& image : images)
+    image_data scratch; // decompression target for compressed images
+
+    for (auto const& stored_image : images)
     {
+        auto const& image = stored_image.decompressed(scratch);
         auto const path = cc::string(folder) + cc::format("{:06}/{:06}/", image.id % output_folder_count, image.id);
         auto const filename_class = path + cc::format("class_{:06}.png", iteration);
         auto const filename_id = path + cc::format("id_{:06}.png", iteration);
@@ -143,39 +483,50 @@ void tp::write_images(cc::span<image_data const> images, cc::string_view folder,
     }
 }
 
-void tp::write_token_sequences(cc::span<image_data const> image_data, cc::string output_folder, int folder_modulus)
+cc::string tp::sequence_file_path(image_data const& image, cc::string_view folder, int folder_modulus, bool per_image_folder, sequence_encoding encoding)
 {
-    for (auto const& image : image_data)
+    auto const name = strip_extension(image.filename);
+    auto const extension = sequence_file_extension(encoding);
+    if (per_image_folder)
+        return cc::string(folder) + cc::format("{:06}/{:06}/{}_sequence{}", image.id % folder_modulus, image.id, name, extension);
+    return cc::string(folder) + cc::format("{:06}/{}_sequence{}", image.id % folder_modulus, name, extension);
+}
+
+void tp::create_sequence_folders(cc::span<image_data const> images, cc::string_view folder, int folder_modulus, bool per_image_folders)
+{
+    auto const make_directory = [](cc::string const& path)
     {
-        auto raw_data = cc::vector<std::byte>();
-        auto writer = babel::make_byte_writer(raw_data);
+        // a single mkdir, the parent already exists
+        std::error_code error;
+        std::filesystem::create_directory(path.c_str(), error);
+        if (error)
+            LOG_ERROR("Could not create output folder {}: {}", path, error.message());
+    };
+
+    // only the buckets that are used
+    cc::vector<bool> used_buckets;
+    used_buckets.resize(folder_modulus, false);
+    for (auto const& image : images)
+        used_buckets[image.id % folder_modulus] = true;
 
-        auto const& class_image = image.current_token_class;
-        auto const& id_image = image.current_token_id;
-        cc::set<int> visited;
+#pragma omp parallel for schedule(dynamic, 16)
+    for (auto bucket = 0; bucket < folder_modulus; ++bucket)
+        if (used_buckets[bucket])
+            make_directory(cc::string(folder) + cc::format("{:06}", bucket));
 
-        for (auto y = 0; y < class_image.height(); ++y)
-            for (auto x = 0; x < class_image.width(); ++x)
-            {
-                auto const id = id_image(x, y);
-                if (visited.contains(id))
-                    continue;
-                visited.add(id);
-
-                auto const token_class = class_image(x, y);
-                writer.write_i32(token_class);
-
-                auto const ancor = image.token_ancor[id];
-                CC_ASSERT(ancor.x == x && ancor.y == y);
-                writer.write_i32(ancor.x);
-                writer.write_i32(ancor.y);
-            }
+    if (!per_image_folders)
+        return;
 
-        auto filepath
-            = output_folder
-              + cc::format("{:06}/{:06}/{}_sequence.dat", image.id % folder_modulus, image.id, image.filename.substring(0, image.filename.size() - 4));
-        babel::file::write(filepath, raw_data);
-    }
+#pragma omp parallel for schedule(dynamic, 64)
+    for (auto i = 0; i < int(images.size()); ++i)
+        make_directory(cc::string(folder) + cc::format("{:06}/{:06}", images[i].id % folder_modulus, images[i].id));
+}
+
+void tp::write_token_sequences(cc::span<image_data const> image_data, cc::string output_folder, int folder_modulus, settings const& settings)
+{
+    sequence_writer writer(cc::move(output_folder), folder_modulus, settings);
+    writer.submit(image_data);
+    writer.finish();
 }
 
 void tp::write_token_shapes(cc::span<token_data const> tokens, cc::string token_data_folder)
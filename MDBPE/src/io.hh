@@ -1,20 +1,93 @@
 #pragma once
 
+#include <cstddef>
+
 #include "clean-core/string_view.hh"
 
 #include <image/image.hh>
 
 #include "image_data.hh"
 #include "rule.hh"
+#include "settings.hh"
 #include "token_data.hh"
 
 namespace tp
 {
+/// a single input file, found by list_input_files or listed in a manifest
+struct input_file
+{
+    cc::string path;     // full path
+    cc::string filename; // filename including extension
+    int id = -1;         // image id, parsed from the filename or given by the manifest
+    size_t offset = 0;   // start of the .dat data inside the file
+    size_t length = 0;   // length of the .dat data; 0 = up to the end of the file
+    size_t size = 0;     // file size if known (large files are memory-mapped), 0 = unknown
+};
+
 /// reads a single .dat file into a integer class image
+/// large files are memory-mapped instead of being read into a buffer
 img::image<int> read_token_bin_data(cc::string_view filepath);
 
-/// read all .dat files in the given folder into images
-cc::vector<image_data> read_folder(cc::string_view folder);
+/// parses the content of a .dat file into a integer class image
+/// well-formed files are bulk-copied; malformed ones go through a checked path that reports the problem
+/// and returns an empty image. 'source' is only used for error messages
+img::image<int> parse_token_bin_data(cc::span<std::byte const> data, cc::string_view source = "<memory>");
+
+/// 'filename' without its extension, i.e. without everything from the last '.' after the last '/' ("a/img_3.jpeg" -> "a/img_3")
+cc::string_view strip_extension(cc::string_view filename);
+
+/// parses the image id from a filename stem, either "{id}" or "{name}_{id}"
+bool parse_image_id(cc::string_view stem, int& id);
+
+/// extensions of the input files in a plain input folder (".dat")
+cc::span<cc::string_view const> input_extensions();
+
+/// recursively lists all .dat files in the given folder, sorted by path
+cc::vector<input_file> list_input_files(cc::string_view folder);
+
+/// same as above, but lists the files with one of the given extensions (including the dot, e.g. ".png")
+cc::vector<input_file> list_input_files(cc::string_view folder, cc::span<cc::string_view const> extensions);
+
+/// reads 'length' bytes at 'offset' of a file (length 0 = up to the end), reports errors instead of asserting
+/// a range that does not lie inside the file is an error
+bool read_file_bytes(cc::string_view filepath, size_t offset, size_t length, cc::vector<std::byte>& data);
+
+/// writes 'data' to a file, replacing it, reports errors instead of asserting
+bool write_file_bytes(cc::string_view filepath, cc::span<std::byte const> data);
+
+/// number of files read_input_files and read_raster_folder read per batch, i.e. whose raw bytes are in memory at once
+/// 'worker_count' and 'io_depth' default like for read_input_files
+int read_batch_size(int worker_count, int io_depth);
+
+/// reads the given .dat files into images
+/// up to 'io_depth' files are read at once with the given backend and parsed by 'worker_count' threads (0 = one per core)
+/// the image order is the order of 'files', independent of thread count and completion order
+cc::vector<image_data> read_input_files(cc::span<input_file const> files,
+                                        int worker_count = 0,
+                                        int io_depth = 0,
+                                        io_backend backend = io_backend::threads);
+
+/// read all .dat files in the given folder into images, in sorted path order (see read_input_files)
+cc::vector<image_data> read_folder(cc::string_view folder, int worker_count = 0, int io_depth = 0, io_backend backend = io_backend::threads);
+
+/// removes images without pixels (malformed inputs), keeping the order
+void remove_empty_images(cc::vector<image_data>& images);
+
+/// returns true if the input path is a shard file (see shard.hh) rather than a folder
+bool is_shard_input(cc::string_view input);
+
+/// returns true if the input path is a manifest file (.manifest)
+bool is_manifest_input(cc::string_view input);
+
+/// reads a manifest: one "<path> <id> [<offset> <length>]" line per image, '#' starts a comment
+/// relative paths are relative to the manifest, offset/length select a .dat range inside a larger file
+/// the manifest order is the image order, so a manifest listing a subset gives a reproducible sample
+/// nothing is stat'ed, missing files are only reported when they are read
+cc::vector<input_file> read_manifest(cc::string_view manifest_file);
+
+/// reads the input data set: a shard file, a .npy or IDX tensor (see tensor_io.hh), tar archives (see tar.hh), a manifest or a folder of .dat files
+/// with settings.raster_input, the folder holds raster images that are quantised into 'class_count' (token_max + 1) classes (see raster.hh)
+cc::vector<image_data> read_input(cc::string_view input, settings const& settings, int class_count);
 
 /// write an integer image, mapping each integer to a color given by 'colors'
 void write(cc::string_view filepath, img::image<int> const& image, cc::span<tg::color3 const> colors);
@@ -25,8 +98,17 @@ void write(cc::string_view filepath, img::image<int> const& image, int max_color
 /// write all debug images
 void write_images(cc::span<image_data const> images, cc::string_view folder, int iteration, int output_folder_count, cc::span<tg::color3 const> class_color);
 
+/// path of the sequence file of an image: {folder}{id % folder_modulus}/[{id}/]{name}_sequence.dat (.cdat for compact sequences)
+cc::string sequence_file_path(
+    image_data const& image, cc::string_view folder, int folder_modulus, bool per_image_folder, sequence_encoding encoding = sequence_encoding::raw);
+
+/// creates the folders sequence_file_path needs for all images ('folder' itself must exist)
+/// only the used buckets are created, with one mkdir each, and the per-image folders only if requested; both in parallel
+void create_sequence_folders(cc::span<image_data const> images, cc::string_view folder, int folder_modulus, bool per_image_folders);
+
 /// write all token sequences into the output folder, using 'folder_modulus' folders
-void write_token_sequences(cc::span<image_data const> image_dat, cc::string output_folder, int folder_modulus);
+/// sequences are serialised and written in the background by a sequence_writer (see sequence_writer.hh)
+void write_token_sequences(cc::span<image_data const> image_dat, cc::string output_folder, int folder_modulus, settings const& settings = {});
 
 /// write all token shapes into the token data folder
 void write_token_shapes(cc::span<token_data const> tokens, cc::string token_data_folder);
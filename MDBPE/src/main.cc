@@ -4,6 +4,8 @@
 
 #include <typed-geometry/types/size.hh>
 
+#include <sequence_codec.hh>
+#include <shard.hh>
 #include <tokenizer.hh>
 
 int main(int /*argc*/, char** /*args*/)
@@ -15,19 +17,55 @@ int main(int /*argc*/, char** /*args*/)
     auto const image_dimensions = tg::isize2(12, 12); // width and height of the images
     auto const output_folder_count = 128;            // number of folders to create in the output folder. for ImageNet, you may want this to be 1024 or something; make sure we don't put 500000 files into one folder :)
 
+    tp::settings settings;
+    settings.memory_budget_mb = 0;                         // refuse to start if the predicted peak memory exceeds this (in MiB); 0 disables the check
+    settings.compress_inactive_images = false;             // keep images lz4-compressed while no rule applies to them; saves memory on large datasets
+    settings.read_worker_count = 0;                        // threads parsing input files; 0 = one per core
+    settings.read_io_depth = 0;                            // files read concurrently; 0 = same as read_worker_count
+    settings.map_tensor_inputs = true;                     // .npy / IDX inputs are memory-mapped and read lazily
+    settings.io = tp::io_backend::threads;                 // io_uring: batched asynchronous reads and writes on Linux (falls back to threads)
+    settings.write_io_depth = 0;                           // output files written concurrently; 0 = one per core
+    settings.sequences = tp::sequence_output::files;       // indexed: offset-table files (sequence_file.hh); padded: [N, L] .npy; tar: tar shards
+    settings.sequence_shard_count = 1;                     // indexed: number of sequence files
+    settings.length_index = false;                         // indexed: write a length index ({prefix}.lengths) for length-bucketed batching
+    settings.length_bucket_width = 8;                      // indexed: token-count range per length bucket
+    settings.group_by_length = false;                      // indexed: one sequence file per length bucket instead of shards
+    settings.per_image_folders = true;                     // files: one folder per image inside its bucket; false avoids one mkdir per image
+    settings.encoding = tp::sequence_encoding::raw;        // compact: varint/delta coded sequences (.cdat), see sequence_codec.hh
+    settings.compression = tp::sequence_compression::none; // compact: lz4 / zstd on top
+    settings.padded_length = 0;                            // padded: fixed sequence length for [N, L] .npy tensors; 0 = longest sequence
+    settings.pad_class = -1;                               // padded: class of the padding cells
+    settings.tar_shard_mb = 1024;                          // tar: WebDataset-style shards of at most this many MiB, plus an index
+    settings.checkpoint_sizes = {};                        // e.g. {64, 128}: also write these vocabulary sizes to checkpoint_{n:05}/
+    settings.checkpoint_sequences = false;                 // checkpoints also get the transcribed training set
+    settings.debug_image_stride = 0;                       // draw every n-th image into one contact sheet per iteration (debug/); 0 = off
+    settings.debug_iteration_stride = 1;                   // contact sheet every n-th iteration
+    settings.raster_input = tp::raster_mode::none;         // grayscale / palette: input folder holds PNG/JPEG images, quantised while reading
+
     cc::string const input_folder = "../data/data_cpp/"; // this should be the exported sequence of tokens, e.g. exported VQ-VAE tokens (see what the python processor does for reference!)
+                                                         // can also be a .shard file, an N x H x W .npy file, an MNIST IDX file, tar archives ("train-{000..099}.tar")
+                                                         // or a .manifest listing "<path> <id> [<offset> <length>]" per image (no directory walk)
     cc::string const output_folder = "../data/data_cpp_out/";
 
-    tp::tokenize(token_max, tokens_to_create, image_dimensions, input_folder, output_folder, output_folder_count);
+    // optional: pack the input folder into a single memory-mapped shard file once, then use the .shard file as input_folder
+    // tp::convert_folder_to_shard(input_folder, "../data/data_cpp.shard", 1); // 1, 2 or 4 bytes per class, depending on token_max
+
+    // optional: convert the _sequence.dat files of an earlier run into compact .cdat files
+    // tp::convert_sequences_to_compact("../data/data_cpp_out/transcribed_data/", tp::sequence_compression::none);
+
+    tp::tokenize(token_max, tokens_to_create, image_dimensions, input_folder, output_folder, output_folder_count, settings);
 
     // ============================================== Apply Rules =========================================
 
     cc::string const test_set_input_folder = input_folder;
     cc::string const test_set_output_folder = "../data/data_cpp_test_out/";
-    cc::string const rule_file = "../data/data_cpp_out/rules.dat";
-    cc::string const token_folder = "../data/data_cpp_out/tokens/";
+    cc::string const vocabulary_file = "../data/data_cpp_out/vocabulary.vocab"; // rules and token shapes in one file, loaded with one mmap
+
+    tp::apply_vocabulary_to_folder(vocabulary_file, test_set_input_folder, test_set_output_folder, output_folder_count, settings);
 
-    tp::apply_rules_to_folder(rule_file, token_folder, test_set_input_folder, test_set_output_folder, output_folder_count);
+    // or from the separate rules.dat and tokens/ folder:
+    // tp::apply_rules_to_folder("../data/data_cpp_out/rules.dat", "../data/data_cpp_out/tokens/", test_set_input_folder, test_set_output_folder,
+    //                           output_folder_count, settings);
 
     return EXIT_SUCCESS;
 }
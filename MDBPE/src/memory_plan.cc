@@ -0,0 +1,175 @@
+#include "memory_plan.hh"
+
+#include <filesystem>
+
+#include <clean-core/pair.hh>
+
+#include <typed-geometry/tg.hh>
+
+#include <rich-log/log.hh>
+
+#include "constellation.hh"
+#include "image_data.hh"
+#include "io.hh"
+#include "raster.hh"
+#include "shard.hh"
+#include "tar.hh"
+#include "tensor_io.hh"
+
+namespace
+{
+// cc::vector doubles its capacity on push_back
+size_t grown_capacity(size_t count)
+{
+    size_t capacity = 1;
+    while (capacity < count)
+        capacity <<= 1;
+    return capacity;
+}
+
+// cc::map / cc::set: one forward_list node per entry (next pointer + malloc overhead) and one bucket per entry (rounded up)
+template <class EntryT>
+size_t hash_table_bytes(size_t entries)
+{
+    if (entries == 0)
+        return 0;
+    auto const node_bytes = sizeof(void*) + sizeof(EntryT) + 2 * sizeof(void*);
+    return entries * node_bytes + grown_capacity(entries) * sizeof(void*);
+}
+
+double to_mib(size_t bytes) { return double(bytes) / (1024.0 * 1024.0); }
+}
+
+void tp::stat_input(cc::string_view input, int& image_count, size_t& max_file_size, raster_mode raster)
+{
+    image_count = 0;
+    max_file_size = 0;
+
+    // same dispatch as read_input: a raster folder takes precedence over the file types
+    auto const extensions = raster != raster_mode::none ? raster_extensions() : input_extensions();
+
+    if (raster == raster_mode::none && is_shard_input(input))
+    {
+        shard_header header;
+        if (read_shard_header(input, header))
+            image_count = header.image_count;
+        return;
+    }
+
+    if (raster == raster_mode::none && (is_npy_input(input) || is_idx_input(input)))
+    {
+        image_count = tg::max(0, tensor_image_count(input));
+        return;
+    }
+
+    if (raster == raster_mode::none && is_manifest_input(input))
+    {
+        // no stat calls, so only ranged entries contribute to the input buffer
+        auto const files = read_manifest(input);
+        image_count = int(files.size());
+        for (auto const& file : files)
+            max_file_size = tg::max(max_file_size, file.length);
+        return;
+    }
+
+    if (raster == raster_mode::none && is_tar_input(input))
+    {
+        LOG_WARN("Cannot count the images in tar archives without reading them, the memory budget is not enforced for {}", input);
+        return;
+    }
+
+    auto const path = std::filesystem::path(input.begin(), input.end());
+    if (!std::filesystem::exists(path))
+        return;
+
+    for (auto const& entry : std::filesystem::recursive_directory_iterator(path))
+    {
+        if (!entry.is_regular_file())
+            continue;
+
+        // only the files the input mode reads (see list_input_files)
+        auto const extension = cc::string(entry.path().extension().string());
+        auto accepted = false;
+        for (auto const& e : extensions)
+            accepted = accepted || cc::string_view(extension) == e;
+        if (!accepted)
+            continue;
+
+        ++image_count;
+        max_file_size = tg::max(max_file_size, size_t(entry.file_size()));
+    }
+}
+
+tp::memory_plan tp::plan_memory(int image_count, tg::isize2 image_size, int token_max, int tokens_to_create, size_t max_file_size, int batch_size)
+{
+    memory_plan plan;
+    plan.image_count = image_count;
+
+    auto const n = size_t(image_count);
+    auto const pixels = size_t(image_size.width) * size_t(image_size.height);
+    auto const plane_bytes = pixels * sizeof(int);
+
+    // three planes per image (initial, current class, current id), plus the struct and its filename
+    plan.image_planes = n * (3 * plane_bytes + sizeof(image_data) + 32);
+
+    // every merge adds an ancor, and an image can be merged at most 'pixels - 1' times
+    auto const max_ancors = tg::max(size_t(1), 2 * pixels - 1);
+    plan.token_ancors = n * grown_capacity(max_ancors) * sizeof(tg::ipos2);
+
+    // distinct constellations are bounded by the number of adjacent pairs in the data set
+    // and by the number of class pairs times the number of possible ancor offsets
+    auto const pairs_per_image = size_t(tg::max(0, image_size.width - 1)) * size_t(image_size.height)
+                                 + size_t(image_size.width) * size_t(tg::max(0, image_size.height - 1));
+    auto const classes = size_t(token_max + 1 + tokens_to_create);
+    auto const offsets = size_t(2 * image_size.width - 1) * size_t(2 * image_size.height - 1);
+    auto const distinct_constellations = tg::min(n * pairs_per_image, classes * classes * offsets);
+    plan.count_table = hash_table_bytes<cc::pair<constellation, int>>(distinct_constellations)
+                       + hash_table_bytes<cc::pair<tg::ipos2, tg::ipos2>>(image_count > 0 ? pairs_per_image : 0);
+
+    // the readers keep the raw files of a whole batch in memory next to the parsed images
+    plan.input_buffer = size_t(tg::clamp(batch_size, 1, tg::max(1, image_count))) * max_file_size;
+
+    return plan;
+}
+
+int tp::max_images_for_budget(tg::isize2 image_size, int token_max, int tokens_to_create, size_t budget_bytes, size_t max_file_size, int batch_size)
+{
+    // the plan is monotonic in the image count, so a binary search suffices
+    auto lo = 0;
+    auto hi = 1;
+    while (hi < (1 << 30) && plan_memory(hi, image_size, token_max, tokens_to_create, max_file_size, batch_size).total() <= budget_bytes)
+        hi <<= 1;
+
+    while (lo + 1 < hi)
+    {
+        auto const mid = lo + (hi - lo) / 2;
+        if (plan_memory(mid, image_size, token_max, tokens_to_create, max_file_size, batch_size).total() <= budget_bytes)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+bool tp::check_memory_budget(memory_plan const& plan,
+                             size_t budget_bytes,
+                             tg::isize2 image_size,
+                             int token_max,
+                             int tokens_to_create,
+                             size_t max_file_size,
+                             int batch_size)
+{
+    LOG("Memory plan for {} images: {:.1f} MiB (images {:.1f}, ancors {:.1f}, count table {:.1f}, input buffer {:.1f})", plan.image_count,
+        to_mib(plan.total()), to_mib(plan.image_planes), to_mib(plan.token_ancors), to_mib(plan.count_table), to_mib(plan.input_buffer));
+
+    if (budget_bytes == 0 || plan.total() <= budget_bytes)
+        return true;
+
+    auto const max_images = max_images_for_budget(image_size, token_max, tokens_to_create, budget_bytes, max_file_size, batch_size);
+    LOG_ERROR("Predicted peak memory of {:.1f} MiB exceeds the budget of {:.1f} MiB", to_mib(plan.total()), to_mib(budget_bytes));
+    if (max_images > 0)
+        LOG_ERROR("Use a sample of at most {} images to stay within the budget", max_images);
+    else
+        LOG_ERROR("Not even a single image fits into the budget");
+    return false;
+}
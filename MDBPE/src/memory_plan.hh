@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+
+#include <clean-core/string_view.hh>
+
+#include <typed-geometry/types/size.hh>
+
+#include "settings.hh"
+
+namespace tp
+{
+/// predicted peak memory of a tokenizer run, all sizes in bytes
+/// the estimate is an upper bound, real runs usually need less for the count table
+struct memory_plan
+{
+    int image_count = 0;
+    size_t image_planes = 0; // image_data itself: initial class, current class and current id planes
+    size_t token_ancors = 0; // token_ancor, including the growth caused by merged tokens
+    size_t count_table = 0;  // constellation count table and the per image 'used' set
+    size_t input_buffer = 0; // raw bytes of a read batch (see read_batch_size), each counted as the largest input file
+
+    size_t total() const { return image_planes + token_ancors + count_table + input_buffer; }
+};
+
+/// stats the input without reading any image: number of images and size of the largest input file
+/// folders use the same filter as read_folder, shards and tensors only read their header (and are mapped, so no input buffer)
+/// manifests are only parsed, without stat'ing the listed files. 'raster' is settings::raster_input, like for read_input
+void stat_input(cc::string_view input, int& image_count, size_t& max_file_size, raster_mode raster = raster_mode::none);
+
+/// predicts the peak memory of tokenizing 'image_count' images of the given size
+/// 'batch_size' is the number of input files read at once, see read_batch_size
+memory_plan plan_memory(int image_count, tg::isize2 image_size, int token_max, int tokens_to_create, size_t max_file_size = 0, int batch_size = 1);
+
+/// returns the largest image count that still fits into 'budget_bytes' (0 if not even a single image fits)
+int max_images_for_budget(
+    tg::isize2 image_size, int token_max, int tokens_to_create, size_t budget_bytes, size_t max_file_size = 0, int batch_size = 1);
+
+/// logs the plan and checks it against the budget
+/// returns false (and suggests a smaller sample) if the budget is exceeded, a budget of 0 always passes
+bool check_memory_budget(memory_plan const& plan,
+                         size_t budget_bytes,
+                         tg::isize2 image_size,
+                         int token_max,
+                         int tokens_to_create,
+                         size_t max_file_size = 0,
+                         int batch_size = 1);
+}
@@ -0,0 +1,171 @@
+#include "padded_export.hh"
+
+#include <bit>
+#include <cstdio>
+#include <initializer_list>
+
+#include <omp.h>
+
+#include <clean-core/array.hh>
+#include <clean-core/string.hh>
+#include <clean-core/vector.hh>
+
+#include <typed-geometry/tg.hh>
+
+#include <rich-log/log.hh>
+
+#include "sequence_codec.hh"
+#include "tensor_io.hh"
+#include "util.hh"
+
+namespace
+{
+/// one output .npy file, the header is written on open and the rows are appended
+struct npy_stream
+{
+    std::FILE* file = nullptr;
+    cc::string filepath;
+    bool ok = false;
+
+    bool open(cc::string path, cc::string_view descr, cc::span<int64_t const> shape)
+    {
+        filepath = cc::move(path);
+        file = std::fopen(filepath.c_str(), "wb");
+        if (!file)
+        {
+            LOG_ERROR("Could not open tensor file for writing: {}", filepath);
+            return false;
+        }
+        auto const header = tp::make_npy_header(descr, shape);
+        ok = std::fwrite(header.data(), 1, header.size(), file) == header.size();
+        return ok;
+    }
+
+    /// writes the values little-endian like the header says, on big-endian hosts they are converted in place
+    template <class T>
+    void append(cc::span<T> values)
+    {
+        if constexpr (std::endian::native == std::endian::big && sizeof(T) > 1)
+            for (auto& v : values)
+                v = tp::byteswap(v);
+        ok = ok && std::fwrite(values.data(), sizeof(T), values.size(), file) == values.size();
+    }
+
+    bool close()
+    {
+        if (!file)
+            return false;
+        ok = std::fclose(file) == 0 && ok;
+        file = nullptr;
+        if (!ok)
+            LOG_ERROR("Could not write tensor file: {}", filepath);
+        return ok;
+    }
+};
+}
+
+bool tp::write_padded_sequences(
+    cc::span<image_data const> images, cc::string_view prefix, settings const& settings, padded_export_stats* stats, int worker_count)
+{
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+
+    auto const count = int(images.size());
+
+    // first pass: sequence lengths, for L and the truncation statistics
+    cc::vector<int> lengths;
+    lengths.resize(count);
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 16)
+    for (auto i = 0; i < count; ++i)
+    {
+        image_data scratch;
+        lengths[i] = token_sequence_length(images[i].decompressed(scratch));
+    }
+
+    padded_export_stats s;
+    s.sequence_count = count;
+    for (auto const l : lengths)
+    {
+        s.max_length = tg::max(s.max_length, l);
+        s.total_tokens += l;
+    }
+    s.padded_length = settings.padded_length > 0 ? settings.padded_length : s.max_length;
+    auto const L = s.padded_length;
+    for (auto const l : lengths)
+        if (l > L)
+        {
+            ++s.truncated_sequences;
+            s.dropped_tokens += l - L;
+        }
+
+    // second pass: extract the sequences again batch by batch and stream the rows
+    auto const matrix_shape = cc::array<int64_t, 2>{int64_t(count), int64_t(L)};
+    auto const vector_shape = cc::array<int64_t, 1>{int64_t(count)};
+    npy_stream classes, ancor_x, ancor_y, mask, lengths_file, ids;
+    auto success = classes.open(cc::string(prefix) + "_classes.npy", "<i4", matrix_shape) //
+                   && ancor_x.open(cc::string(prefix) + "_ancor_x.npy", "<i4", matrix_shape)
+                   && ancor_y.open(cc::string(prefix) + "_ancor_y.npy", "<i4", matrix_shape)
+                   && mask.open(cc::string(prefix) + "_mask.npy", "|u1", matrix_shape)
+                   && lengths_file.open(cc::string(prefix) + "_lengths.npy", "<i4", vector_shape)
+                   && ids.open(cc::string(prefix) + "_ids.npy", "<i4", vector_shape);
+
+    auto const batch_size = tg::max(1, worker_count * 256);
+    auto const row_cells = size_t(L);
+    cc::vector<int32_t> class_rows, x_rows, y_rows, length_rows, id_rows;
+    cc::vector<uint8_t> mask_rows;
+
+    for (auto batch_begin = 0; batch_begin < count && success; batch_begin += batch_size)
+    {
+        auto const batch_end = tg::min(count, batch_begin + batch_size);
+        auto const batch_count = size_t(batch_end - batch_begin);
+        class_rows.resize(batch_count * row_cells);
+        x_rows.resize(batch_count * row_cells);
+        y_rows.resize(batch_count * row_cells);
+        mask_rows.resize(batch_count * row_cells);
+        length_rows.resize(batch_count);
+        id_rows.resize(batch_count);
+
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 16)
+        for (auto i = batch_begin; i < batch_end; ++i)
+        {
+            cc::vector<sequence_token> tokens;
+            image_data scratch;
+            extract_token_sequence(images[i].decompressed(scratch), tokens);
+
+            auto const row = size_t(i - batch_begin);
+            auto const length = tg::min(int(tokens.size()), L);
+            for (auto t = 0; t < L; ++t)
+            {
+                auto const cell = row * row_cells + size_t(t);
+                auto const valid = t < length;
+                class_rows[cell] = valid ? tokens[t].token_class : settings.pad_class;
+                x_rows[cell] = valid ? tokens[t].ancor.x : 0;
+                y_rows[cell] = valid ? tokens[t].ancor.y : 0;
+                mask_rows[cell] = valid ? 1 : 0;
+            }
+            length_rows[row] = length;
+            id_rows[row] = images[i].id;
+        }
+
+        classes.append<int32_t>(class_rows);
+        ancor_x.append<int32_t>(x_rows);
+        ancor_y.append<int32_t>(y_rows);
+        mask.append<uint8_t>(mask_rows);
+        lengths_file.append<int32_t>(length_rows);
+        ids.append<int32_t>(id_rows);
+        success = classes.ok && ancor_x.ok && ancor_y.ok && mask.ok && lengths_file.ok && ids.ok;
+    }
+
+    for (auto* f : {&classes, &ancor_x, &ancor_y, &mask, &lengths_file, &ids})
+        success = f->close() && success;
+
+    if (success)
+    {
+        LOG("Wrote {} token sequences as [{}, {}] tensors to {}_*.npy", count, count, L, prefix);
+        LOG("Longest sequence {}, mean {:.1f}; {} sequence(s) truncated, {} of {} tokens dropped", s.max_length,
+            count > 0 ? double(s.total_tokens) / count : 0.0, s.truncated_sequences, s.dropped_tokens, s.total_tokens);
+    }
+    if (stats)
+        *stats = s;
+    return success;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+#include <clean-core/span.hh>
+#include <clean-core/string_view.hh>
+
+#include "image_data.hh"
+#include "settings.hh"
+
+namespace tp
+{
+/// what write_padded_sequences did to fit the sequences into [N, L]
+struct padded_export_stats
+{
+    int sequence_count = 0;
+    int padded_length = 0;       // L
+    int max_length = 0;          // longest sequence before truncation
+    int truncated_sequences = 0; // sequences longer than L
+    int64_t total_tokens = 0;    // tokens before truncation
+    int64_t dropped_tokens = 0;  // tokens cut off by the truncation
+};
+
+/// writes the token sequences of all images as dense, fixed-length .npy tensors for training (C-order, little-endian):
+///   {prefix}_classes.npy  int32 [N, L], settings.pad_class after the end of a sequence
+///   {prefix}_ancor_x.npy  int32 [N, L], ancor positions, 0 after the end
+///   {prefix}_ancor_y.npy  int32 [N, L]
+///   {prefix}_mask.npy     uint8 [N, L], 1 for tokens, 0 for padding (the attention mask)
+///   {prefix}_lengths.npy  int32 [N], sequence lengths after truncation
+///   {prefix}_ids.npy      int32 [N], image ids
+/// L is settings.padded_length, or the longest sequence if 0; longer sequences are truncated and counted in 'stats'
+/// the sequences are extracted on 'worker_count' threads (0 = one per core) and streamed to disk in batches
+bool write_padded_sequences(cc::span<image_data const> images,
+                            cc::string_view prefix,
+                            settings const& settings = {},
+                            padded_export_stats* stats = nullptr,
+                            int worker_count = 0);
+}
@@ -0,0 +1,160 @@
+#include "raster.hh"
+
+#include <omp.h>
+
+#include <typed-geometry/tg.hh>
+
+#include <babel-serializer/image/image.hh>
+
+#include <rich-log/log.hh>
+
+#include "async_io.hh"
+#include "io.hh"
+
+namespace
+{
+float color_distance_sqr(tg::color3 const& a, tg::color3 const& b)
+{
+    auto const dr = a.r - b.r;
+    auto const dg = a.g - b.g;
+    auto const db = a.b - b.b;
+    return dr * dr + dg * dg + db * db;
+}
+}
+
+cc::span<cc::string_view const> tp::raster_extensions()
+{
+    static cc::string_view const extensions[] = {".png", ".jpg", ".jpeg", ".bmp", ".tga"};
+    return extensions;
+}
+
+img::image<int> tp::quantise_raster(
+    cc::span<std::byte const> data, raster_mode mode, int class_count, cc::span<tg::color3 const> palette, cc::string_view source)
+{
+    auto const channels = mode == raster_mode::palette ? babel::image::channels::rgb : babel::image::channels::grey;
+
+    babel::image::read_config cfg;
+    cfg.desired_bit_depth = babel::image::bit_depth::u8;
+    cfg.desired_channels = channels;
+
+    // the default handler asserts, a broken file should only drop this image
+    auto failed = false;
+    auto const on_error = [&](cc::span<std::byte const>, cc::span<std::byte const>, cc::string_view message, babel::severity s)
+    {
+        if (s == babel::severity::error)
+        {
+            LOG_ERROR("Could not decode {}: {}", source, message);
+            failed = true;
+        }
+    };
+    auto const decoded = babel::image::read(data, cfg, on_error);
+    if (failed || decoded.bytes.empty())
+        return {};
+
+    auto const width = decoded.width;
+    auto const height = decoded.height;
+    auto const pixels = reinterpret_cast<uint8_t const*>(decoded.bytes.data());
+    img::image<int> image(tg::isize2(width, height));
+
+    if (mode == raster_mode::grayscale)
+    {
+        // lookup table: level of each 8 bit gray value
+        int levels[256];
+        for (auto v = 0; v < 256; ++v)
+            levels[v] = v * class_count / 256;
+
+        for (auto y = 0; y < height; ++y)
+            for (auto x = 0; x < width; ++x)
+                image(x, y) = levels[pixels[x + y * width]];
+        return image;
+    }
+
+    for (auto y = 0; y < height; ++y)
+        for (auto x = 0; x < width; ++x)
+        {
+            auto const p = pixels + (x + y * width) * 3;
+            auto const color = tg::color3(p[0] / 255.0f, p[1] / 255.0f, p[2] / 255.0f);
+
+            auto best = 0;
+            auto best_distance = color_distance_sqr(color, palette[0]);
+            for (auto i = 1; i < int(palette.size()); ++i)
+            {
+                auto const distance = color_distance_sqr(color, palette[i]);
+                if (distance < best_distance)
+                {
+                    best = i;
+                    best_distance = distance;
+                }
+            }
+            image(x, y) = best;
+        }
+    return image;
+}
+
+cc::vector<tp::image_data> tp::read_raster_folder(cc::string_view folder,
+                                                  raster_mode mode,
+                                                  int class_count,
+                                                  cc::span<tg::color3 const> palette,
+                                                  int worker_count,
+                                                  int io_depth,
+                                                  io_backend backend)
+{
+    if (mode == raster_mode::none)
+    {
+        LOG_ERROR("No raster mode given for the raster input {}", folder);
+        return {};
+    }
+    if (mode == raster_mode::grayscale && (class_count < 1 || class_count > 256))
+    {
+        LOG_ERROR("Cannot quantise 8 bit gray values into {} classes", class_count);
+        return {};
+    }
+    if (mode == raster_mode::palette && (palette.empty() || int(palette.size()) > class_count))
+    {
+        LOG_ERROR("The raster palette needs between 1 and {} colors, got {}", class_count, palette.size());
+        return {};
+    }
+
+    auto const files = list_input_files(folder, raster_extensions());
+    auto const file_count = int(files.size());
+
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+    if (io_depth <= 0)
+        io_depth = worker_count;
+
+    cc::vector<image_data> images;
+    images.resize(file_count);
+
+    // same batching as read_input_files: up to 'io_depth' reads are in flight, 'worker_count' threads decode
+    auto const batch_size = read_batch_size(worker_count, io_depth);
+    io_queue queue(io_depth, backend);
+    cc::vector<read_request> requests;
+
+    for (auto batch_begin = 0; batch_begin < file_count; batch_begin += batch_size)
+    {
+        auto const batch_end = tg::min(file_count, batch_begin + batch_size);
+
+        // fresh requests per batch, so no result of the previous batch is left over
+        requests.clear();
+        for (auto i = batch_begin; i < batch_end; ++i)
+            requests.emplace_back().path = files[i].path;
+        queue.read(requests); // failed reads are reported and left empty
+
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 4)
+        for (auto i = batch_begin; i < batch_end; ++i)
+        {
+            auto& request = requests[i - batch_begin];
+            if (request.ok)
+            {
+                auto image = quantise_raster(request.data, mode, class_count, palette, files[i].path);
+                if (image.pixel_count() > 0)
+                    images[i] = image_data(files[i].filename, files[i].id, cc::move(image));
+            }
+            request.data = {};
+        }
+    }
+
+    remove_empty_images(images);
+    return images;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <clean-core/span.hh>
+#include <clean-core/string_view.hh>
+#include <clean-core/vector.hh>
+
+#include "image_data.hh"
+#include "settings.hh"
+
+namespace tp
+{
+/// extensions of the raster formats read_raster_folder accepts
+cc::span<cc::string_view const> raster_extensions();
+
+/// decodes a raster image (PNG, JPEG, BMP, TGA) and quantises it into classes 0 .. class_count - 1
+/// grayscale: the gray value is split into 'class_count' equally sized levels, palette: index of the closest palette color
+/// returns an empty image (and reports the problem) if the data cannot be decoded
+img::image<int> quantise_raster(cc::span<std::byte const> data,
+                                raster_mode mode,
+                                int class_count,
+                                cc::span<tg::color3 const> palette,
+                                cc::string_view source = "<memory>");
+
+/// reads all raster images in the given folder into images, ids are parsed from the filenames like for .dat files
+/// no intermediate .dat files are written, decoding runs on 'worker_count' threads with up to 'io_depth' reads in flight (0 = one per core)
+cc::vector<image_data> read_raster_folder(cc::string_view folder,
+                                          raster_mode mode,
+                                          int class_count,
+                                          cc::span<tg::color3 const> palette,
+                                          int worker_count = 0,
+                                          int io_depth = 0,
+                                          io_backend backend = io_backend::threads);
+}
@@ -0,0 +1,358 @@
+#include "sequence_codec.hh"
+
+#include <climits>
+#include <filesystem>
+
+#include <omp.h>
+
+#include <typed-geometry/tg.hh>
+
+#include <babel-serializer/compression/lz4.hh>
+#include <babel-serializer/compression/zstd.hh>
+
+#include <rich-log/log.hh>
+
+#include "async_io.hh"
+#include "io.hh"
+#include "util.hh"
+
+namespace
+{
+constexpr size_t raw_token_bytes = 3 * sizeof(int32_t);
+constexpr size_t lz4_max_ratio = 255; // an lz4 sequence expands to at most 255 bytes per compressed byte
+
+void write_varint(cc::vector<std::byte>& data, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        data.push_back(std::byte(v | 0x80));
+        v >>= 7;
+    }
+    data.push_back(std::byte(v));
+}
+
+bool read_varint(cc::span<std::byte const> data, size_t& pos, uint64_t& v)
+{
+    v = 0;
+    for (auto shift = 0; shift < 64 && pos < data.size(); shift += 7)
+    {
+        auto const b = uint64_t(data[pos++]);
+        v |= (b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+// the error handler of babel asserts by default, malformed files should only be reported
+struct report_errors
+{
+    cc::string_view source;
+    bool failed = false;
+
+    void operator()(cc::span<std::byte const>, cc::span<std::byte const>, cc::string_view message, babel::severity s)
+    {
+        if (s == babel::severity::error)
+        {
+            LOG_ERROR("Could not decompress sequence {}: {}", source, message);
+            failed = true;
+        }
+    }
+};
+
+bool decode_compact_body(cc::span<std::byte const> body, cc::vector<tp::sequence_token>& tokens, cc::string_view source)
+{
+    size_t pos = 0;
+    uint64_t width = 0;
+    uint64_t count = 0;
+    if (!read_varint(body, pos, width) || !read_varint(body, pos, count) || width == 0 || count > body.size())
+    {
+        LOG_ERROR("Malformed compact sequence header: {}", source);
+        return false;
+    }
+
+    tokens.resize(count);
+    int64_t index = -1;
+    for (auto& token : tokens)
+    {
+        uint64_t token_class = 0;
+        uint64_t delta = 0;
+        if (!read_varint(body, pos, token_class) || !read_varint(body, pos, delta))
+        {
+            LOG_ERROR("Compact sequence is truncated: {}", source);
+            return false;
+        }
+        index += int64_t(delta) + 1;
+        token.token_class = int(token_class);
+        token.ancor = {int(index % int64_t(width)), int(index / int64_t(width))};
+    }
+
+    if (pos != body.size())
+    {
+        LOG_ERROR("Compact sequence has {} trailing bytes: {}", body.size() - pos, source);
+        return false;
+    }
+    return true;
+}
+
+// raw files are read from disk, so everything the compact encoding relies on is checked before encoding them
+// the width is the smallest one that keeps the raster indices of the ancors increasing
+bool compact_width(cc::span<tp::sequence_token const> tokens, int& width, cc::string_view source)
+{
+    width = 1;
+    for (auto const& token : tokens)
+    {
+        if (token.token_class < 0 || token.ancor.x < 0 || token.ancor.y < 0 || token.ancor.x == INT_MAX)
+        {
+            LOG_ERROR("Sequence contains token class {} at ({}, {}), compact sequences need non-negative classes and ancors: {}",
+                      token.token_class, token.ancor.x, token.ancor.y, source);
+            return false;
+        }
+        width = tg::max(width, token.ancor.x + 1);
+    }
+
+    int64_t previous_index = -1;
+    for (auto const& token : tokens)
+    {
+        auto const index = int64_t(token.ancor.y) * width + token.ancor.x;
+        if (index <= previous_index)
+        {
+            LOG_ERROR("Sequence ancor ({}, {}) is not in raster order: {}", token.ancor.x, token.ancor.y, source);
+            return false;
+        }
+        previous_index = index;
+    }
+    return true;
+}
+}
+
+void tp::extract_token_sequence(image_data const& image, cc::vector<sequence_token>& tokens)
+{
+    tokens.clear();
+
+    auto const& class_image = image.current_token_class;
+    auto const& id_image = image.current_token_id;
+    cc::vector<bool> visited;
+    visited.resize(image.max_token_id(), false);
+
+    for (auto y = 0; y < class_image.height(); ++y)
+        for (auto x = 0; x < class_image.width(); ++x)
+        {
+            auto const id = id_image(x, y);
+            if (visited[id])
+                continue;
+            visited[id] = true;
+
+            auto const ancor = image.token_ancor[id];
+            CC_ASSERT(ancor.x == x && ancor.y == y);
+            tokens.push_back({class_image(x, y), ancor});
+        }
+}
+
+int tp::token_sequence_length(image_data const& image)
+{
+    auto const& id_image = image.current_token_id;
+    cc::vector<bool> visited;
+    visited.resize(image.max_token_id(), false);
+
+    auto length = 0;
+    for (auto y = 0; y < id_image.height(); ++y)
+        for (auto x = 0; x < id_image.width(); ++x)
+        {
+            auto const id = id_image(x, y);
+            length += !visited[id];
+            visited[id] = true;
+        }
+    return length;
+}
+
+void tp::encode_token_sequence(image_data const& image, cc::vector<std::byte>& data, sequence_encoding encoding, sequence_compression compression)
+{
+    cc::vector<sequence_token> tokens;
+    extract_token_sequence(image, tokens);
+    encode_token_sequence(tokens, image.current_token_class.width(), data, encoding, compression);
+}
+
+void tp::encode_token_sequence(
+    cc::span<sequence_token const> tokens, int width, cc::vector<std::byte>& data, sequence_encoding encoding, sequence_compression compression)
+{
+    data.clear();
+
+    if (encoding == sequence_encoding::raw)
+    {
+        data.reserve(tokens.size() * raw_token_bytes);
+        for (auto const& token : tokens)
+        {
+            write_le<int32_t>(data, token.token_class);
+            write_le<int32_t>(data, token.ancor.x);
+            write_le<int32_t>(data, token.ancor.y);
+        }
+        return;
+    }
+
+    cc::vector<std::byte> body;
+    body.reserve(4 + tokens.size() * 3);
+    write_varint(body, uint64_t(width));
+    write_varint(body, tokens.size());
+    int64_t previous_index = -1;
+    for (auto const& token : tokens)
+    {
+        CC_ASSERT(token.token_class >= 0 && "compact sequences store non-negative classes");
+        auto const index = int64_t(token.ancor.y) * width + token.ancor.x;
+        CC_ASSERT(index > previous_index && "ancors are in raster order");
+        write_varint(body, uint64_t(token.token_class));
+        write_varint(body, uint64_t(index - previous_index - 1));
+        previous_index = index;
+    }
+
+    switch (compression)
+    {
+    case sequence_compression::none:
+        data.push_back(std::byte(0));
+        data.push_back_range(body);
+        break;
+    case sequence_compression::lz4:
+        data.push_back(std::byte(1));
+        write_varint(data, body.size());
+        data.push_back_range(babel::lz4::compress(body));
+        break;
+    case sequence_compression::zstd:
+        data.push_back(std::byte(2));
+        write_varint(data, body.size());
+        data.push_back_range(babel::zstd::compress(body));
+        break;
+    }
+}
+
+bool tp::decode_token_sequence(cc::span<std::byte const> data, sequence_encoding encoding, cc::vector<sequence_token>& tokens, cc::string_view source)
+{
+    tokens.clear();
+
+    if (encoding == sequence_encoding::raw)
+    {
+        if (data.size() % raw_token_bytes != 0)
+        {
+            LOG_ERROR("Sequence size {} is not a multiple of {} bytes: {}", data.size(), raw_token_bytes, source);
+            return false;
+        }
+        tokens.resize(data.size() / raw_token_bytes);
+        for (size_t i = 0; i < tokens.size(); ++i)
+        {
+            auto const token = data.data() + i * raw_token_bytes;
+            tokens[i].token_class = read_le<int32_t>(token);
+            tokens[i].ancor = {read_le<int32_t>(token + 4), read_le<int32_t>(token + 8)};
+        }
+        return true;
+    }
+
+    if (data.empty())
+    {
+        LOG_ERROR("Empty compact sequence: {}", source);
+        return false;
+    }
+
+    auto const codec = int(data[0]);
+    if (codec == 0)
+        return decode_compact_body(data.subspan(1), tokens, source);
+
+    size_t pos = 1;
+    uint64_t body_size = 0;
+    if ((codec != 1 && codec != 2) || !read_varint(data, pos, body_size))
+    {
+        LOG_ERROR("Unknown compact sequence codec {}: {}", codec, source);
+        return false;
+    }
+
+    // the size is allocated before decompressing, a corrupt one must not request more than the compressed bytes can expand to
+    auto const compressed = data.subspan(pos);
+    if (codec == 1 && body_size > compressed.size() * lz4_max_ratio + lz4_max_ratio)
+    {
+        LOG_ERROR("Compact sequence claims {} bytes, more than its {} lz4 bytes can hold: {}", body_size, compressed.size(), source);
+        return false;
+    }
+
+    report_errors on_error{source};
+    auto const body = codec == 1 ? babel::lz4::uncompress(compressed, body_size, on_error) : babel::zstd::uncompress(compressed, on_error);
+    if (on_error.failed || body.size() != body_size)
+    {
+        if (!on_error.failed)
+            LOG_ERROR("Compact sequence decompressed to {} bytes instead of {}: {}", body.size(), body_size, source);
+        return false;
+    }
+    return decode_compact_body(body, tokens, source);
+}
+
+cc::string_view tp::sequence_file_extension(sequence_encoding encoding) { return encoding == sequence_encoding::compact ? ".cdat" : ".dat"; }
+
+bool tp::read_token_sequence(cc::string_view filepath, cc::vector<sequence_token>& tokens)
+{
+    cc::vector<std::byte> data;
+    if (!read_file_bytes(filepath, 0, 0, data))
+        return false;
+    auto const encoding = filepath.ends_with(".cdat") ? sequence_encoding::compact : sequence_encoding::raw;
+    return decode_token_sequence(data, encoding, tokens, filepath);
+}
+
+bool tp::convert_sequences_to_compact(cc::string_view folder, sequence_compression compression, bool remove_originals, int worker_count)
+{
+    auto const path = std::filesystem::path(folder.begin(), folder.end());
+    if (!std::filesystem::exists(path))
+    {
+        LOG_ERROR("Sequence folder does not exist: {}", folder);
+        return false;
+    }
+
+    cc::vector<cc::string> files;
+    for (auto const& entry : std::filesystem::recursive_directory_iterator(path))
+        if (entry.is_regular_file() && entry.path().filename().string().ends_with("_sequence.dat"))
+            files.push_back(cc::string(entry.path().string()));
+
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+
+    auto success = true;
+    auto converted = 0;
+    int64_t raw_bytes = 0;
+    int64_t compact_bytes = 0;
+
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 16) reduction(&& : success) reduction(+ : converted, raw_bytes, compact_bytes)
+    for (auto i = 0; i < int(files.size()); ++i)
+    {
+        auto const& file = files[i];
+        cc::vector<std::byte> data;
+        cc::vector<sequence_token> tokens;
+        if (!read_file_bytes(file, 0, 0, data) || !decode_token_sequence(data, sequence_encoding::raw, tokens, file))
+        {
+            success = false;
+            continue;
+        }
+
+        // raw files do not store the width, malformed ones are skipped
+        auto width = 1;
+        if (!compact_width(tokens, width, file))
+        {
+            success = false;
+            continue;
+        }
+
+        cc::vector<std::byte> compact;
+        encode_token_sequence(tokens, width, compact, sequence_encoding::compact, compression);
+
+        auto const target = file.substring(0, file.size() - 4) + ".cdat";
+        if (!write_file_bytes(target, compact))
+        {
+            success = false;
+            continue;
+        }
+
+        converted += 1;
+        raw_bytes += int64_t(data.size());
+        compact_bytes += int64_t(compact.size());
+        if (remove_originals)
+            std::filesystem::remove(file.c_str());
+    }
+
+    LOG("Converted {} of {} sequences: {} bytes -> {} bytes ({:.2f}x smaller)", converted, files.size(), raw_bytes, compact_bytes,
+        double(raw_bytes) / double(tg::max(int64_t(1), compact_bytes)));
+    return success;
+}
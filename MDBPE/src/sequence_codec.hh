@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+
+#include <clean-core/span.hh>
+#include <clean-core/string_view.hh>
+#include <clean-core/vector.hh>
+
+#include <typed-geometry/types/pos.hh>
+
+#include "image_data.hh"
+#include "settings.hh"
+
+namespace tp
+{
+/// a single token of a sequence: its class and its ancor (the first pixel of the token in raster order)
+struct sequence_token
+{
+    int token_class = 0;
+    tg::ipos2 ancor;
+};
+
+/// extracts the token sequence of an image, tokens in raster order of their ancors
+void extract_token_sequence(image_data const& image, cc::vector<sequence_token>& tokens);
+
+/// number of tokens extract_token_sequence would return, without building the sequence
+int token_sequence_length(image_data const& image);
+
+/// encodes the token sequence of an image into 'data'
+///
+/// raw:     per token int32 class, ancor x, ancor y (the classic _sequence.dat layout)
+/// compact: codec byte (0 none, 1 lz4, 2 zstd), [varint size of the uncompressed body], body:
+///          varint image width, varint token count, per token varint class and varint (raster index - previous raster index - 1)
+void encode_token_sequence(image_data const& image,
+                           cc::vector<std::byte>& data,
+                           sequence_encoding encoding = sequence_encoding::raw,
+                           sequence_compression compression = sequence_compression::none);
+
+/// same as above, but for an already extracted sequence (compact needs the image width)
+/// compact needs non-negative classes and ancors in raster order, as extract_token_sequence returns them
+void encode_token_sequence(cc::span<sequence_token const> tokens,
+                           int width,
+                           cc::vector<std::byte>& data,
+                           sequence_encoding encoding = sequence_encoding::raw,
+                           sequence_compression compression = sequence_compression::none);
+
+/// decodes an encoded sequence, returns false (and reports the problem) on malformed data
+bool decode_token_sequence(cc::span<std::byte const> data,
+                           sequence_encoding encoding,
+                           cc::vector<sequence_token>& tokens,
+                           cc::string_view source = "<memory>");
+
+/// file extension of a sequence file in the given encoding (".dat" or ".cdat")
+cc::string_view sequence_file_extension(sequence_encoding encoding);
+
+/// reads a _sequence.dat or _sequence.cdat file
+bool read_token_sequence(cc::string_view filepath, cc::vector<sequence_token>& tokens);
+
+/// converts all _sequence.dat files below 'folder' into compact _sequence.cdat files next to them
+/// the originals are only removed if 'remove_originals' is set and the conversion succeeded, malformed files are reported and skipped
+bool convert_sequences_to_compact(cc::string_view folder, sequence_compression compression, bool remove_originals = false, int worker_count = 0);
+}
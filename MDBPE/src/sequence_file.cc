@@ -0,0 +1,423 @@
+#include "sequence_file.hh"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include <omp.h>
+
+#include <clean-core/format.hh>
+#include <clean-core/sort.hh>
+
+#include <typed-geometry/tg.hh>
+
+#include <rich-log/log.hh>
+
+#include "io.hh"
+#include "util.hh"
+
+namespace
+{
+constexpr char sequence_magic[4] = {'M', 'D', 'B', 'Q'};
+constexpr int32_t sequence_version = 2;
+constexpr size_t sequence_header_bytes = sizeof(sequence_magic) + 3 * sizeof(int32_t);
+constexpr size_t sequence_header_bytes_v1 = sizeof(sequence_magic) + 2 * sizeof(int32_t);
+constexpr size_t sequence_entry_bytes = 2 * sizeof(int32_t) + sizeof(int64_t);
+
+constexpr char length_magic[4] = {'M', 'D', 'B', 'L'};
+constexpr int32_t length_version = 1;
+constexpr size_t length_header_bytes = sizeof(length_magic) + 4 * sizeof(int32_t);
+constexpr size_t length_bucket_bytes = 4 * sizeof(int32_t);
+constexpr size_t length_entry_bytes = 4 * sizeof(int32_t);
+
+/// a sequence file and the images it holds: images[order[i]] for i in [begin, end)
+struct sequence_part
+{
+    cc::string filepath;
+    int begin = 0;
+    int end = 0;
+};
+
+bool write_sequence_file(cc::span<tp::image_data const> images,
+                         cc::span<int const> order,
+                         cc::string const& filepath,
+                         tp::sequence_encoding encoding,
+                         tp::sequence_compression compression,
+                         int worker_count)
+{
+    auto const file = std::fopen(filepath.c_str(), "wb");
+    if (!file)
+    {
+        LOG_ERROR("Could not open sequence file for writing: {}", filepath);
+        return false;
+    }
+
+    auto const count = int(order.size());
+    auto const payload_offset = int64_t(sequence_header_bytes + size_t(count) * sequence_entry_bytes);
+
+    // the payload is streamed behind the (not yet known) index table, which is written last
+    auto success = tp::seek_file(file, payload_offset);
+
+    cc::vector<tp::sequence_index_entry> index;
+    index.resize(count);
+
+    auto const batch_size = tg::max(1, worker_count * 256);
+    cc::vector<cc::vector<std::byte>> sequences;
+    cc::vector<cc::vector<tp::sequence_token>> tokens;
+    sequences.resize(batch_size);
+    tokens.resize(batch_size);
+    auto offset = payload_offset;
+
+    for (auto batch_begin = 0; batch_begin < count && success; batch_begin += batch_size)
+    {
+        auto const batch_end = tg::min(count, batch_begin + batch_size);
+
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 16)
+        for (auto i = batch_begin; i < batch_end; ++i)
+        {
+            tp::image_data scratch; // decompression target for compressed images
+            auto const& image = images[order[i]].decompressed(scratch);
+            auto& sequence_tokens = tokens[i - batch_begin];
+            tp::extract_token_sequence(image, sequence_tokens);
+            tp::encode_token_sequence(sequence_tokens, image.current_token_class.width(), sequences[i - batch_begin], encoding, compression);
+        }
+
+        for (auto i = batch_begin; i < batch_end && success; ++i)
+        {
+            auto const& sequence = sequences[i - batch_begin];
+            index[i].id = images[order[i]].id;
+            index[i].token_count = int32_t(tokens[i - batch_begin].size());
+            index[i].offset = offset;
+            offset += int64_t(sequence.size());
+            success = std::fwrite(sequence.data(), 1, sequence.size(), file) == sequence.size();
+        }
+    }
+
+    if (success)
+    {
+        cc::vector<std::byte> table;
+        table.push_back_range(cc::span<std::byte const>(reinterpret_cast<std::byte const*>(sequence_magic), sizeof(sequence_magic)));
+        tp::write_le<int32_t>(table, sequence_version);
+        tp::write_le<int32_t>(table, count);
+        tp::write_le<int32_t>(table, int32_t(encoding));
+        for (auto const& entry : index)
+        {
+            tp::write_le<int32_t>(table, entry.id);
+            tp::write_le<int32_t>(table, entry.token_count);
+            tp::write_le<int64_t>(table, entry.offset);
+        }
+        success = tp::seek_file(file, 0) && std::fwrite(table.data(), 1, table.size(), file) == table.size();
+    }
+
+    success = std::fclose(file) == 0 && success;
+    if (!success)
+        LOG_ERROR("Could not write sequence file: {}", filepath);
+    return success;
+}
+
+bool write_length_index(cc::span<tp::image_data const> images,
+                        cc::span<int const> lengths,
+                        cc::span<int const> order,
+                        cc::span<sequence_part const> parts,
+                        int bucket_width,
+                        cc::string const& filepath)
+{
+    // entries in file order, then grouped by bucket (stable, so already grouped files stay in file order)
+    cc::vector<tp::length_index_entry> entries;
+    entries.reserve(order.size());
+    for (auto file = 0; file < int(parts.size()); ++file)
+        for (auto i = parts[file].begin; i < parts[file].end; ++i)
+            entries.push_back({images[order[i]].id, lengths[order[i]], file, i - parts[file].begin});
+    cc::vector<int> positions;
+    positions.resize(entries.size());
+    for (auto i = 0; i < int(entries.size()); ++i)
+        positions[i] = i;
+    auto const bucket_of = [&](int i) { return entries[i].token_count / bucket_width; };
+    cc::sort(positions, [&](int a, int b) { return bucket_of(a) != bucket_of(b) ? bucket_of(a) < bucket_of(b) : a < b; });
+
+    cc::vector<tp::length_index_entry> sorted;
+    cc::vector<tp::length_bucket> buckets;
+    sorted.reserve(entries.size());
+    for (auto const p : positions)
+    {
+        auto const& entry = entries[p];
+        auto const bucket = entry.token_count / bucket_width;
+        if (buckets.empty() || buckets.back().min_length != bucket * bucket_width)
+            buckets.push_back({bucket * bucket_width, bucket * bucket_width + bucket_width - 1, int32_t(sorted.size()), 0});
+        ++buckets.back().count;
+        sorted.push_back(entry);
+    }
+
+    cc::vector<std::byte> data;
+    data.push_back_range(cc::span<std::byte const>(reinterpret_cast<std::byte const*>(length_magic), sizeof(length_magic)));
+    tp::write_le<int32_t>(data, length_version);
+    tp::write_le<int32_t>(data, int32_t(sorted.size()));
+    tp::write_le<int32_t>(data, int32_t(buckets.size()));
+    tp::write_le<int32_t>(data, int32_t(parts.size()));
+    for (auto const& part : parts)
+    {
+        auto const name = std::filesystem::path(part.filepath.c_str()).filename().string();
+        tp::write_le<int32_t>(data, int32_t(name.size()));
+        data.push_back_range(cc::span<std::byte const>(reinterpret_cast<std::byte const*>(name.data()), name.size()));
+    }
+    for (auto const& bucket : buckets)
+    {
+        tp::write_le<int32_t>(data, bucket.min_length);
+        tp::write_le<int32_t>(data, bucket.max_length);
+        tp::write_le<int32_t>(data, bucket.first);
+        tp::write_le<int32_t>(data, bucket.count);
+    }
+    for (auto const& entry : sorted)
+    {
+        tp::write_le<int32_t>(data, entry.id);
+        tp::write_le<int32_t>(data, entry.token_count);
+        tp::write_le<int32_t>(data, entry.file);
+        tp::write_le<int32_t>(data, entry.index);
+    }
+
+    if (!tp::write_file_bytes(filepath, data))
+        return false;
+    LOG("Wrote a length index with {} bucket(s) of width {}: {}", buckets.size(), bucket_width, filepath);
+    return true;
+}
+}
+
+cc::vector<cc::string> tp::sequence_file_names(cc::string_view prefix, int shard_count)
+{
+    cc::vector<cc::string> names;
+    if (shard_count <= 1)
+        names.push_back(cc::string(prefix) + ".seq");
+    else
+        for (auto shard = 0; shard < shard_count; ++shard)
+            names.push_back(cc::string(prefix) + cc::format("-{:05}.seq", shard));
+    return names;
+}
+
+bool tp::write_sequence_files(cc::span<image_data const> images, cc::string_view prefix, settings const& settings, int worker_count)
+{
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+
+    auto const count = int(images.size());
+    auto const with_length_index = settings.length_index || settings.group_by_length;
+    auto const bucket_width = tg::max(1, settings.length_bucket_width);
+
+    cc::vector<int> order;
+    order.resize(count);
+    for (auto i = 0; i < count; ++i)
+        order[i] = i;
+
+    // token counts for the length index, computed up front since grouping needs them before anything is written
+    cc::vector<int> lengths;
+    if (with_length_index)
+    {
+        lengths.resize(count);
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 16)
+        for (auto i = 0; i < count; ++i)
+        {
+            image_data scratch;
+            lengths[i] = token_sequence_length(images[i].decompressed(scratch));
+        }
+    }
+
+    cc::vector<sequence_part> parts;
+    if (settings.group_by_length)
+    {
+        // images keep their relative order inside a bucket
+        cc::sort(order, [&](int a, int b) { return lengths[a] / bucket_width != lengths[b] / bucket_width ? lengths[a] < lengths[b] : a < b; });
+        for (auto begin = 0; begin < count;)
+        {
+            auto const bucket = lengths[order[begin]] / bucket_width;
+            auto end = begin;
+            while (end < count && lengths[order[end]] / bucket_width == bucket)
+                ++end;
+            parts.push_back({cc::string(prefix) + cc::format("-len{:05}.seq", bucket * bucket_width), begin, end});
+            begin = end;
+        }
+    }
+    else
+    {
+        auto const shard_count = tg::max(1, settings.sequence_shard_count);
+        auto const names = sequence_file_names(prefix, shard_count);
+        for (auto shard = 0; shard < shard_count; ++shard)
+            parts.push_back({names[shard], int(int64_t(count) * shard / shard_count), int(int64_t(count) * (shard + 1) / shard_count)});
+    }
+
+    auto success = true;
+    for (auto const& part : parts)
+    {
+        auto const part_order = cc::span<int const>(order).subspan(part.begin, part.end - part.begin);
+        success = write_sequence_file(images, part_order, part.filepath, settings.encoding, settings.compression, worker_count) && success;
+    }
+
+    if (success && with_length_index)
+        success = write_length_index(images, lengths, order, parts, bucket_width, cc::string(prefix) + ".lengths");
+
+    if (success)
+        LOG("Wrote {} token sequences to {} file(s) at {}", count, parts.size(), prefix);
+    return success;
+}
+
+tp::sequence_file::sequence_file(cc::string_view filepath)
+{
+    if (!babel::file::exists(filepath))
+    {
+        LOG_ERROR("Sequence file does not exist: {}", filepath);
+        return;
+    }
+
+    auto file = std::make_shared<babel::file::memory_mapped_file<std::byte const>>(filepath);
+    auto const data = file->data();
+    auto const size = size_t(file->size());
+
+    if (size < sequence_header_bytes_v1 || std::memcmp(data, sequence_magic, sizeof(sequence_magic)) != 0)
+    {
+        LOG_ERROR("Not a sequence file: {}", filepath);
+        return;
+    }
+
+    // version 1 files have no encoding field and always hold raw sequences
+    auto const version = read_le<int32_t>(data + 4);
+    auto const count = read_le<int32_t>(data + 8);
+    if (version != 1 && version != sequence_version)
+    {
+        LOG_ERROR("Unsupported sequence file version {}: {}", version, filepath);
+        return;
+    }
+    auto const header_bytes = version == 1 ? sequence_header_bytes_v1 : sequence_header_bytes;
+    if (size < header_bytes)
+    {
+        LOG_ERROR("Not a sequence file: {}", filepath);
+        return;
+    }
+
+    auto const encoding = version == 1 ? 0 : read_le<int32_t>(data + 12);
+    if (encoding != int32_t(sequence_encoding::raw) && encoding != int32_t(sequence_encoding::compact))
+    {
+        LOG_ERROR("Unknown sequence encoding {}: {}", encoding, filepath);
+        return;
+    }
+    m_encoding = sequence_encoding(encoding);
+
+    if (count < 0 || size < header_bytes + size_t(count) * sequence_entry_bytes)
+    {
+        LOG_ERROR("Sequence file is too small for its index of {} sequences: {}", count, filepath);
+        return;
+    }
+
+    // sequences are stored in index order, so every sequence ends where the next one starts
+    m_index.resize(count);
+    auto previous_offset = int64_t(header_bytes + size_t(count) * sequence_entry_bytes);
+    for (auto i = 0; i < count; ++i)
+    {
+        auto const entry = data + header_bytes + size_t(i) * sequence_entry_bytes;
+        auto& e = m_index[i];
+        e.id = read_le<int32_t>(entry);
+        e.token_count = read_le<int32_t>(entry + 4);
+        e.offset = read_le<int64_t>(entry + 8);
+
+        if (e.token_count < 0 || e.offset < previous_offset || size_t(e.offset) > size)
+        {
+            LOG_ERROR("Sequence {} (id {}) lies outside of the payload: {}", i, e.id, filepath);
+            m_index.clear();
+            return;
+        }
+        previous_offset = e.offset;
+    }
+
+    m_filepath = filepath;
+    m_file = cc::move(file);
+}
+
+bool tp::sequence_file::decode(int i, cc::vector<sequence_token>& tokens) const
+{
+    if (!decode_token_sequence(sequence(i), m_encoding, tokens, m_filepath))
+        return false;
+    if (int(tokens.size()) != token_count(i))
+    {
+        LOG_ERROR("Sequence {} has {} tokens, but its index says {}: {}", i, tokens.size(), token_count(i), m_filepath);
+        return false;
+    }
+    return true;
+}
+
+tp::sequence_length_index::sequence_length_index(cc::string_view filepath)
+{
+    cc::vector<std::byte> bytes;
+    if (!read_file_bytes(filepath, 0, 0, bytes))
+        return;
+    auto const data = bytes.data();
+    auto const size = bytes.size();
+
+    if (size < length_header_bytes || std::memcmp(data, length_magic, sizeof(length_magic)) != 0)
+    {
+        LOG_ERROR("Not a length index: {}", filepath);
+        return;
+    }
+    auto const version = read_le<int32_t>(data + 4);
+    if (version != length_version)
+    {
+        LOG_ERROR("Unsupported length index version {}: {}", version, filepath);
+        return;
+    }
+    auto const count = read_le<int32_t>(data + 8);
+    auto const bucket_count = read_le<int32_t>(data + 12);
+    auto const file_count = read_le<int32_t>(data + 16);
+    if (count < 0 || bucket_count < 0 || file_count < 0)
+    {
+        LOG_ERROR("Corrupt length index header: {}", filepath);
+        return;
+    }
+
+    auto pos = length_header_bytes;
+    for (auto f = 0; f < file_count; ++f)
+    {
+        if (pos + 4 > size || pos + 4 + size_t(read_le<int32_t>(data + pos)) > size)
+        {
+            LOG_ERROR("Truncated file table in length index: {}", filepath);
+            return;
+        }
+        auto const length = size_t(read_le<int32_t>(data + pos));
+        m_files.push_back(cc::string(cc::string_view(reinterpret_cast<char const*>(data + pos + 4), length)));
+        pos += 4 + length;
+    }
+
+    if (size != pos + size_t(bucket_count) * length_bucket_bytes + size_t(count) * length_entry_bytes)
+    {
+        LOG_ERROR("Length index has {} bytes, but its header requires {}: {}", size,
+                  pos + size_t(bucket_count) * length_bucket_bytes + size_t(count) * length_entry_bytes, filepath);
+        return;
+    }
+
+    m_buckets.resize(bucket_count);
+    for (auto& bucket : m_buckets)
+    {
+        bucket.min_length = read_le<int32_t>(data + pos);
+        bucket.max_length = read_le<int32_t>(data + pos + 4);
+        bucket.first = read_le<int32_t>(data + pos + 8);
+        bucket.count = read_le<int32_t>(data + pos + 12);
+        pos += length_bucket_bytes;
+        if (bucket.first < 0 || bucket.count < 0 || int64_t(bucket.first) + bucket.count > count)
+        {
+            LOG_ERROR("Length bucket [{}, {}] lies outside of the entry table: {}", bucket.min_length, bucket.max_length, filepath);
+            return;
+        }
+    }
+
+    m_entries.resize(count);
+    for (auto& entry : m_entries)
+    {
+        entry.id = read_le<int32_t>(data + pos);
+        entry.token_count = read_le<int32_t>(data + pos + 4);
+        entry.file = read_le<int32_t>(data + pos + 8);
+        entry.index = read_le<int32_t>(data + pos + 12);
+        pos += length_entry_bytes;
+        if (entry.file < 0 || entry.file >= file_count)
+        {
+            LOG_ERROR("Length index entry of image {} refers to file {} of {}: {}", entry.id, entry.file, file_count, filepath);
+            return;
+        }
+    }
+
+    m_valid = true;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include <clean-core/span.hh>
+#include <clean-core/string.hh>
+#include <clean-core/string_view.hh>
+#include <clean-core/vector.hh>
+
+#include <babel-serializer/file.hh>
+
+#include "image_data.hh"
+#include "sequence_codec.hh"
+#include "settings.hh"
+
+namespace tp
+{
+/// indexed token sequence file: the token sequences of many images in a single file
+///
+/// layout (little-endian):
+///   header:      magic "MDBQ", int32 version, int32 sequence count, int32 encoding (0 raw, 1 compact; since version 2)
+///   index table: per sequence int32 image id, int32 token count, int64 byte offset of the sequence from the start of the file
+///   payload:     the encoded sequences one after the other (see sequence_codec.hh), a sequence ends where the next one starts
+struct sequence_index_entry
+{
+    int32_t id = -1;
+    int32_t token_count = 0;
+    int64_t offset = 0;
+};
+
+/// length index of indexed sequence files ({prefix}.lengths), lets a dataloader batch sequences of similar length
+///
+/// layout (little-endian):
+///   header:       magic "MDBL", int32 version, int32 sequence count, int32 bucket count, int32 file count
+///   file table:   per sequence file int32 name length and the name (relative to the index)
+///   bucket table: per bucket int32 min token count, int32 max token count (inclusive), int32 first entry, int32 entry count
+///   entry table:  per sequence int32 image id, int32 token count, int32 file, int32 index inside that file; grouped by bucket
+/// with settings.group_by_length, bucket b is stored in file b, so the index table of that file is the offset table of the bucket
+struct length_bucket
+{
+    int32_t min_length = 0;
+    int32_t max_length = 0;
+    int32_t first = 0; // first entry of the bucket
+    int32_t count = 0;
+};
+
+struct length_index_entry
+{
+    int32_t id = -1;
+    int32_t token_count = 0;
+    int32_t file = 0;
+    int32_t index = 0;
+};
+
+/// writes the token sequences of all images into settings.sequence_shard_count indexed sequence files
+/// a single file is named "{prefix}.seq", shards "{prefix}-{shard:05}.seq", each shard holds a contiguous range of the images
+/// with settings.group_by_length, the sequences are instead grouped into one "{prefix}-len{min token count:05}.seq" per length bucket
+/// with settings.length_index (or group_by_length), "{prefix}.lengths" is written as well (see length_bucket)
+/// sequences are encoded with settings.encoding / compression on 'worker_count' threads (0 = one per core) and streamed to disk in batches
+bool write_sequence_files(cc::span<image_data const> images, cc::string_view prefix, settings const& settings = {}, int worker_count = 0);
+
+/// returns the filenames write_sequence_files uses for the given prefix and shard count
+cc::vector<cc::string> sequence_file_names(cc::string_view prefix, int shard_count);
+
+/// read access to an indexed sequence file through mmap
+/// after construction, every sequence is available in O(1) without further file access
+struct sequence_file
+{
+public:
+    /// maps the file and validates its index, errors are reported and leave the file invalid
+    explicit sequence_file(cc::string_view filepath);
+
+    bool valid() const { return m_file != nullptr; }
+
+    int size() const { return int(m_index.size()); }
+    int id(int i) const { return m_index[i].id; }
+    int token_count(int i) const { return m_index[i].token_count; }
+
+    sequence_encoding encoding() const { return m_encoding; }
+
+    /// encoded bytes of the i-th sequence
+    cc::span<std::byte const> sequence(int i) const
+    {
+        auto const end = i + 1 < size() ? m_index[i + 1].offset : int64_t(m_file->size());
+        return {m_file->data() + m_index[i].offset, size_t(end - m_index[i].offset)};
+    }
+
+    /// decodes the i-th sequence
+    bool decode(int i, cc::vector<sequence_token>& tokens) const;
+
+private:
+    std::shared_ptr<babel::file::memory_mapped_file<std::byte const>> m_file;
+    cc::vector<sequence_index_entry> m_index;
+    sequence_encoding m_encoding = sequence_encoding::raw;
+    cc::string m_filepath;
+};
+
+/// reads a length index written by write_sequence_files (a few bytes per sequence, so it is read completely)
+struct sequence_length_index
+{
+public:
+    /// reads and validates the index, errors are reported and leave the index invalid
+    explicit sequence_length_index(cc::string_view filepath);
+
+    bool valid() const { return m_valid; }
+
+    /// names of the sequence files, relative to the index
+    cc::span<cc::string const> files() const { return m_files; }
+    cc::span<length_bucket const> buckets() const { return m_buckets; }
+    cc::span<length_index_entry const> entries() const { return m_entries; }
+
+    /// entries of the b-th bucket
+    cc::span<length_index_entry const> bucket_entries(int b) const
+    {
+        return cc::span<length_index_entry const>(m_entries).subspan(m_buckets[b].first, m_buckets[b].count);
+    }
+
+private:
+    cc::vector<cc::string> m_files;
+    cc::vector<length_bucket> m_buckets;
+    cc::vector<length_index_entry> m_entries;
+    bool m_valid = false;
+};
+}
@@ -0,0 +1,118 @@
+#include "sequence_writer.hh"
+
+#include <omp.h>
+
+#include <typed-geometry/tg.hh>
+
+#include <rich-log/log.hh>
+
+#include "async_io.hh"
+#include "io.hh"
+#include "sequence_codec.hh"
+
+namespace
+{
+// images per queued block, a block is serialised and written as one batch
+constexpr int block_size = 256;
+}
+
+tp::sequence_writer::sequence_writer(cc::string folder, int folder_modulus, settings const& settings)
+  : m_folder{cc::move(folder)},
+    m_folder_modulus{folder_modulus},
+    m_per_image_folders{settings.per_image_folders},
+    m_io{settings.io},
+    m_encoding{settings.encoding},
+    m_compression{settings.compression}
+{
+    auto const worker_count = settings.write_io_depth > 0 ? settings.write_io_depth : omp_get_max_threads();
+    m_capacity = size_t(2 * worker_count);
+    m_start = std::chrono::steady_clock::now();
+
+    for (auto i = 0; i < worker_count; ++i)
+        m_workers.emplace_back([this] { work(); });
+}
+
+tp::sequence_writer::~sequence_writer() { finish(); }
+
+void tp::sequence_writer::submit(cc::span<image_data const> images)
+{
+    for (size_t begin = 0; begin < images.size(); begin += block_size)
+    {
+        auto const block = images.subspan(begin, tg::min(size_t(block_size), images.size() - begin));
+
+        std::unique_lock lock(m_mutex);
+        m_not_full.wait(lock, [&] { return m_queue.size() < m_capacity; });
+        m_queue.push_back(block);
+        lock.unlock();
+        m_not_empty.notify_one();
+    }
+}
+
+bool tp::sequence_writer::finish()
+{
+    if (m_workers.empty())
+        return m_failed_files == 0;
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_closing = true;
+    }
+    m_not_empty.notify_all();
+
+    for (auto& worker : m_workers)
+        worker.join();
+    m_workers.clear();
+
+    auto const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    auto const mib = double(m_written_bytes) / (1024.0 * 1024.0);
+    LOG("Wrote {} token sequences ({:.1f} MiB) in {:.2f} s: {:.0f} files/s, {:.1f} MiB/s", int64_t(m_written_files), mib, seconds,
+        double(m_written_files) / tg::max(seconds, 1e-9), mib / tg::max(seconds, 1e-9));
+
+    if (m_failed_files > 0)
+        LOG_ERROR("{} token sequences could not be written", int64_t(m_failed_files));
+    return m_failed_files == 0;
+}
+
+void tp::sequence_writer::work()
+{
+    image_data scratch; // decompression target for compressed images
+    cc::vector<write_request> requests;
+
+    // every writer thread is one write in flight, io_uring keeps a whole block in flight instead
+    io_queue queue(m_io == io_backend::io_uring ? block_size : 1, m_io);
+
+    while (true)
+    {
+        cc::span<image_data const> block;
+        {
+            std::unique_lock lock(m_mutex);
+            m_not_empty.wait(lock, [&] { return !m_queue.empty() || m_closing; });
+            if (m_queue.empty())
+                return; // closing and drained
+            block = m_queue.front();
+            m_queue.pop_front();
+        }
+        m_not_full.notify_one();
+
+        requests.resize(block.size());
+        for (size_t i = 0; i < block.size(); ++i)
+        {
+            auto const& image = block[i].decompressed(scratch);
+            encode_token_sequence(image, requests[i].data, m_encoding, m_compression);
+            requests[i].path = sequence_file_path(image, m_folder, m_folder_modulus, m_per_image_folders, m_encoding);
+        }
+
+        queue.write(requests);
+
+        for (auto const& request : requests)
+        {
+            if (request.ok)
+            {
+                ++m_written_files;
+                m_written_bytes += int64_t(request.data.size());
+            }
+            else
+                ++m_failed_files;
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <clean-core/span.hh>
+#include <clean-core/string.hh>
+#include <clean-core/vector.hh>
+
+#include "image_data.hh"
+#include "settings.hh"
+
+namespace tp
+{
+/// background writer for _sequence.dat (or compact .cdat) files
+/// submitted images are serialised and written by a pool of 'settings.write_io_depth' threads (0 = one per core)
+/// the queue is bounded, so submit blocks while the writers are behind
+struct sequence_writer
+{
+public:
+    sequence_writer(cc::string folder, int folder_modulus, settings const& settings);
+    ~sequence_writer();
+
+    sequence_writer(sequence_writer const&) = delete;
+    sequence_writer& operator=(sequence_writer const&) = delete;
+
+    /// queues the images for writing
+    /// the images must stay alive and unchanged until finish() returns
+    void submit(cc::span<image_data const> images);
+
+    /// waits until all queued sequences are written, logs the throughput
+    /// returns false if any write failed (which is reported)
+    bool finish();
+
+private:
+    void work();
+
+    cc::string m_folder;
+    int m_folder_modulus = 1;
+    bool m_per_image_folders = true;
+    io_backend m_io = io_backend::threads;
+    sequence_encoding m_encoding = sequence_encoding::raw;
+    sequence_compression m_compression = sequence_compression::none;
+
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+    std::deque<cc::span<image_data const>> m_queue; // blocks of images
+    size_t m_capacity = 0;                          // maximum number of queued blocks
+    bool m_closing = false;
+
+    cc::vector<std::thread> m_workers;
+
+    std::atomic<int64_t> m_written_files = 0;
+    std::atomic<int64_t> m_written_bytes = 0;
+    std::atomic<int64_t> m_failed_files = 0;
+    std::chrono::steady_clock::time_point m_start;
+};
+}
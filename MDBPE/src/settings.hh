@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+
+#include <clean-core/vector.hh>
+
+#include <typed-geometry/types/color.hh>
+
+namespace tp
+{
+/// how input files are read and output files are written, see async_io.hh
+enum class io_backend
+{
+    threads,  // blocking reads and writes on a thread pool
+    io_uring, // batched asynchronous I/O on Linux, falls back to threads if io_uring is unavailable
+};
+
+/// how token sequences are written
+enum class sequence_output
+{
+    files,   // one {name}_sequence.dat file per image in {id % output_folder_count}/{id}/ (or only the bucket folder)
+    indexed, // indexed sequence files with an offset table, see sequence_file.hh
+    padded,  // dense fixed-length .npy tensors with an attention mask, see padded_export.hh
+    tar,     // WebDataset-style tar shards with an index, see tar.hh
+};
+
+/// how a single token sequence is encoded, see sequence_codec.hh
+enum class sequence_encoding
+{
+    raw,     // int32 class, ancor x, ancor y per token (12 bytes per token)
+    compact, // varint classes and varint deltas of the raster index of the ancors
+};
+
+/// optional block compression of compact sequences
+enum class sequence_compression
+{
+    none,
+    lz4,
+    zstd,
+};
+
+/// how raster images (PNG, JPEG, ...) are turned into classes, see raster.hh
+enum class raster_mode
+{
+    none,      // the input is not a folder of raster images
+    grayscale, // gray value, quantised to token_max + 1 equally sized levels
+    palette,   // index of the closest color in settings::raster_palette
+};
+
+/// optional settings for tokenize and apply_rules_to_folder
+/// the defaults reproduce the plain behaviour, see main.cc for a config block
+struct settings
+{
+    // memory
+    size_t memory_budget_mb = 0;           // refuse to start if the predicted peak memory exceeds this budget (in MiB); 0 disables the check
+    bool compress_inactive_images = false; // keep images a rule did not change lz4-compressed in memory (less memory, a bit more CPU)
+
+    // input
+    int read_worker_count = 0;     // threads parsing input files; 0 = one per core
+    int read_io_depth = 0;         // files read concurrently; 0 = same as read_worker_count. raise this on network filesystems
+    bool map_tensor_inputs = true; // .npy / IDX inputs: map the file and read image planes lazily (where the element type allows it)
+
+    // file I/O
+    io_backend io = io_backend::threads; // io_uring keeps 'read_io_depth' / 'write_io_depth' requests in flight without a thread each
+    int write_io_depth = 0;              // output files written concurrently; 0 = one per core
+
+    // output
+    sequence_output sequences = sequence_output::files;            // indexed: all sequences in one (or a few) files instead of one file per image
+    int sequence_shard_count = 1;                                  // indexed: number of sequence files
+    bool length_index = false;                                     // indexed: also write {prefix}.lengths, the sequences grouped by token count
+    int length_bucket_width = 8;                                   // indexed: token-count range of a length bucket
+    bool group_by_length = false;                                  // indexed: one sequence file per length bucket (no shards), implies length_index
+    bool per_image_folders = true;                                 // files: one {id}/ folder per sequence inside its bucket (one mkdir per image)
+    sequence_encoding encoding = sequence_encoding::raw;           // compact: varint/delta coded sequences, about 4x smaller (.cdat files)
+    sequence_compression compression = sequence_compression::none; // compact: lz4 or zstd on top of the varint coding
+    int padded_length = 0;                                         // padded: sequence length L, longer sequences are truncated; 0 = longest sequence
+    int pad_class = -1;                                            // padded: class written after the end of a sequence
+    size_t tar_shard_mb = 1024;                                    // tar: maximum size of a tar shard in MiB
+
+    // checkpoints
+    cc::vector<int> checkpoint_sizes;  // tokenize: after this many created tokens, also write rules, tokens and vocabulary to checkpoint_{n:05}/
+    bool checkpoint_sequences = false; // tokenize: checkpoints also get the token sequences of the training set
+
+    // debug output, see contact_sheet.hh
+    int debug_image_stride = 0;     // tokenize: draw every n-th image into a contact sheet (debug/sheet_{iteration}.png); 0 disables it
+    int debug_iteration_stride = 1; // tokenize: draw a sheet every n-th iteration
+    int debug_max_tiles = 256;      // tokenize: images per sheet
+    int debug_upscale = 4;          // tokenize: output pixels per class cell
+
+    // raster input
+    raster_mode raster_input = raster_mode::none; // input folder holds PNG/JPEG/BMP/TGA images that are decoded and quantised while reading
+    cc::vector<tg::color3> raster_palette;        // raster_mode::palette: class i is raster_palette[i], at most token_max + 1 colors
+};
+}
@@ -0,0 +1,206 @@
+#include "shard.hh"
+
+#include <cstring>
+#include <memory>
+
+#include <omp.h>
+
+#include <clean-core/format.hh>
+
+#include <typed-geometry/tg.hh>
+
+#include <babel-serializer/file.hh>
+
+#include <rich-log/log.hh>
+
+#include "io.hh"
+#include "util.hh"
+
+namespace
+{
+constexpr char shard_magic[4] = {'M', 'D', 'B', 'S'};
+constexpr size_t shard_header_bytes = 6 * sizeof(int32_t);
+
+bool parse_shard_header(cc::span<std::byte const> data, tp::shard_header& header, cc::string_view filepath)
+{
+    if (data.size() < shard_header_bytes || std::memcmp(data.data(), shard_magic, sizeof(shard_magic)) != 0)
+    {
+        LOG_ERROR("Not a shard file: {}", filepath);
+        return false;
+    }
+
+    header.version = tp::read_le<int32_t>(data.data() + 4);
+    header.image_count = tp::read_le<int32_t>(data.data() + 8);
+    header.width = tp::read_le<int32_t>(data.data() + 12);
+    header.height = tp::read_le<int32_t>(data.data() + 16);
+    header.class_bytes = tp::read_le<int32_t>(data.data() + 20);
+
+    if (header.version != 1)
+    {
+        LOG_ERROR("Unsupported shard version {}: {}", header.version, filepath);
+        return false;
+    }
+    if (header.image_count < 0 || header.width <= 0 || header.height <= 0
+        || (header.class_bytes != 1 && header.class_bytes != 2 && header.class_bytes != 4))
+    {
+        LOG_ERROR("Invalid shard header ({} images of {}x{}, {} bytes per class): {}", header.image_count, header.width, header.height,
+                  header.class_bytes, filepath);
+        return false;
+    }
+    return true;
+}
+
+size_t shard_plane_bytes(tp::shard_header const& header) { return size_t(header.width) * size_t(header.height) * size_t(header.class_bytes); }
+}
+
+bool tp::read_shard_header(cc::string_view filepath, shard_header& header)
+{
+    if (!babel::file::exists(filepath))
+    {
+        LOG_ERROR("Shard file does not exist: {}", filepath);
+        return false;
+    }
+    auto const mapped_file = babel::file::make_memory_mapped_file_readonly(filepath);
+    return parse_shard_header(cc::span<std::byte const>(mapped_file.data(), mapped_file.size()), header, filepath);
+}
+
+cc::vector<tp::image_data> tp::read_shard(cc::string_view filepath)
+{
+    if (!babel::file::exists(filepath))
+    {
+        LOG_ERROR("Shard file does not exist: {}", filepath);
+        return {};
+    }
+
+    auto mapped_file = std::make_shared<babel::file::memory_mapped_file<std::byte const>>(filepath);
+    auto const data = cc::span<std::byte const>(mapped_file->data(), mapped_file->size());
+
+    shard_header header;
+    if (!parse_shard_header(data, header, filepath))
+        return {};
+
+    auto const ids_offset = shard_header_bytes;
+    auto const payload_offset = ids_offset + size_t(header.image_count) * sizeof(int32_t);
+    auto const plane_bytes = shard_plane_bytes(header);
+    auto const expected_size = payload_offset + size_t(header.image_count) * plane_bytes;
+    if (data.size() != expected_size)
+    {
+        LOG_ERROR("Shard file has {} bytes, but its header requires {}: {}", data.size(), expected_size, filepath);
+        return {};
+    }
+
+    // only the id table is touched here, the planes are paged in when the images are first used
+    cc::vector<image_data> images;
+    images.reserve(header.image_count);
+    for (auto i = 0; i < header.image_count; ++i)
+    {
+        auto const id = read_le<int32_t>(data.data() + ids_offset + i * sizeof(int32_t));
+        auto const plane = data.data() + payload_offset + i * plane_bytes;
+        images.push_back(image_data(cc::format("{}.dat", id), id, {header.width, header.height}, plane, header.class_bytes, mapped_file));
+    }
+    return images;
+}
+
+bool tp::convert_folder_to_shard(cc::string_view folder, cc::string_view shard_file, int class_bytes, int worker_count)
+{
+    if (class_bytes != 1 && class_bytes != 2 && class_bytes != 4)
+    {
+        LOG_ERROR("Bytes per class must be 1, 2 or 4, got {}", class_bytes);
+        return false;
+    }
+
+    auto const files = list_input_files(folder);
+    if (files.empty())
+    {
+        LOG_ERROR("No input files in {}", folder);
+        return false;
+    }
+
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+
+    // the size of the first image defines the size of the shard
+    auto const first_image = read_token_bin_data(files[0].path);
+    if (first_image.pixel_count() == 0)
+        return false;
+
+    shard_header header;
+    header.image_count = int(files.size());
+    header.width = first_image.width();
+    header.height = first_image.height();
+    header.class_bytes = class_bytes;
+
+    auto const max_class = class_bytes == 4 ? int64_t(INT32_MAX) : (int64_t(1) << (8 * class_bytes)) - 1;
+    auto const plane_bytes = shard_plane_bytes(header);
+
+    babel::file::file_output_stream out(shard_file);
+    if (!out.valid())
+    {
+        LOG_ERROR("Could not open shard file for writing: {}", shard_file);
+        return false;
+    }
+
+    // header and id table
+    {
+        cc::vector<std::byte> raw_data;
+        raw_data.push_back_range(cc::span<std::byte const>(reinterpret_cast<std::byte const*>(shard_magic), sizeof(shard_magic)));
+        write_le<int32_t>(raw_data, header.version);
+        write_le<int32_t>(raw_data, header.image_count);
+        write_le<int32_t>(raw_data, header.width);
+        write_le<int32_t>(raw_data, header.height);
+        write_le<int32_t>(raw_data, header.class_bytes);
+        for (auto const& file : files)
+            write_le<int32_t>(raw_data, file.id);
+        out(cc::span<std::byte const>(raw_data));
+    }
+
+    // payload, converted in parallel batches and written in order
+    auto const batch_size = tg::max(1, worker_count * 256);
+    auto payload = cc::vector<std::byte>::uninitialized(size_t(batch_size) * plane_bytes);
+    auto success = true;
+
+    for (auto batch_begin = 0; batch_begin < header.image_count && success; batch_begin += batch_size)
+    {
+        auto const batch_end = tg::min(header.image_count, batch_begin + batch_size);
+
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 4) reduction(&& : success)
+        for (auto i = batch_begin; i < batch_end; ++i)
+        {
+            auto const image = read_token_bin_data(files[i].path);
+            if (image.extents() != first_image.extents())
+            {
+                LOG_ERROR("Image has size {}x{}, but the shard is {}x{}: {}", image.width(), image.height(), header.width, header.height, files[i].path);
+                success = false;
+                continue;
+            }
+
+            auto dst = payload.data() + size_t(i - batch_begin) * plane_bytes;
+            auto const pixels = size_t(image.pixel_count());
+            for (size_t p = 0; p < pixels; ++p)
+            {
+                auto const c = image.data_ptr()[p];
+                if (c < 0 || c > max_class)
+                {
+                    LOG_ERROR("Class {} does not fit into {} bytes: {}", c, class_bytes, files[i].path);
+                    success = false;
+                    break;
+                }
+                auto const v = uint32_t(c);
+                for (auto b = 0; b < class_bytes; ++b)
+                    dst[p * class_bytes + b] = std::byte((v >> (8 * b)) & 0xff);
+            }
+        }
+
+        if (success)
+            out(cc::span<std::byte const>(payload.data(), size_t(batch_end - batch_begin) * plane_bytes));
+    }
+
+    if (!success)
+    {
+        LOG_ERROR("Conversion to shard failed: {}", shard_file);
+        return false;
+    }
+
+    LOG("Wrote {} images of {}x{} to {}", header.image_count, header.width, header.height, shard_file);
+    return true;
+}
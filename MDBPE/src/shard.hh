@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+
+#include <clean-core/string_view.hh>
+#include <clean-core/vector.hh>
+
+#include "image_data.hh"
+
+namespace tp
+{
+/// packed shard data set: the class planes of many equally sized images in a single file
+///
+/// layout (little-endian int32 unless noted):
+///   header:   magic "MDBS", version, image count, width, height, bytes per class (1, 2 or 4)
+///   id table: image count ids
+///   payload:  image count class planes (row-major, 'bytes per class' unsigned bytes each, int32 for 4), one after the other
+struct shard_header
+{
+    int32_t version = 1;
+    int32_t image_count = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+    int32_t class_bytes = 0;
+};
+
+/// reads and validates the header of a shard file
+bool read_shard_header(cc::string_view filepath, shard_header& header);
+
+/// opens a shard file through mmap
+/// the images reference the mapping and read their planes lazily on first use
+cc::vector<image_data> read_shard(cc::string_view filepath);
+
+/// packs all .dat files of a folder into a shard file, in the image order of read_folder
+/// all images must have the same size and every class must fit into 'class_bytes' (1, 2 or 4)
+bool convert_folder_to_shard(cc::string_view folder, cc::string_view shard_file, int class_bytes, int worker_count = 0);
+}
@@ -0,0 +1,500 @@
+#include "tar.hh"
+
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string_view>
+
+#include <omp.h>
+
+#include <clean-core/format.hh>
+#include <clean-core/from_string.hh>
+
+#include <typed-geometry/tg.hh>
+
+#include <rich-log/log.hh>
+
+#include "io.hh"
+#include "sequence_codec.hh"
+
+namespace
+{
+constexpr size_t tar_block_size = 512;
+
+size_t padded_size(size_t size) { return (size + tar_block_size - 1) / tar_block_size * tar_block_size; }
+
+// numeric header fields are octal text, or big-endian base-256 if the high bit of the first byte is set
+bool parse_tar_number(char const* field, size_t field_size, size_t& value)
+{
+    value = 0;
+    if (uint8_t(field[0]) & 0x80)
+    {
+        for (size_t i = 1; i < field_size; ++i)
+            value = (value << 8) | uint8_t(field[i]);
+        return true;
+    }
+
+    size_t i = 0;
+    while (i < field_size && field[i] == ' ')
+        ++i;
+    for (; i < field_size && field[i] >= '0' && field[i] <= '7'; ++i)
+        value = value * 8 + size_t(field[i] - '0');
+    return i == field_size || field[i] == '\0' || field[i] == ' ';
+}
+
+cc::string_view tar_string(char const* field, size_t field_size)
+{
+    auto const len = strnlen(field, field_size);
+    return cc::string_view(field, len);
+}
+
+bool verify_tar_checksum(std::byte const* header)
+{
+    size_t stored = 0;
+    if (!parse_tar_number(reinterpret_cast<char const*>(header) + 148, 8, stored))
+        return false;
+
+    size_t sum = 0;
+    for (size_t i = 0; i < tar_block_size; ++i)
+        sum += (i >= 148 && i < 156) ? size_t(' ') : size_t(uint8_t(header[i]));
+    return sum == stored;
+}
+
+// extracts "path=..." from a pax extended header
+cc::string pax_path(cc::span<std::byte const> records)
+{
+    auto text = cc::string_view(reinterpret_cast<char const*>(records.data()), records.size());
+    while (!text.empty())
+    {
+        // each record is "<length> <key>=<value>\n", the length includes itself
+        auto const [length_str, rest] = text.split_once(" ");
+        size_t length = 0;
+        if (!cc::from_string(length_str, length) || length == 0 || length > text.size())
+            break;
+
+        auto const record = text.subview(length_str.size() + 1, length - length_str.size() - 2);
+        if (record.starts_with("path="))
+            return cc::string(record.subview(5));
+        text = text.subview(length);
+    }
+    return {};
+}
+}
+
+tp::tar_reader::tar_reader(cc::string_view filepath, size_t buffer_size) : m_filepath{filepath}
+{
+    m_file = std::fopen(m_filepath.c_str(), "rb");
+    if (!m_file)
+    {
+        LOG_ERROR("Could not open tar archive: {}", filepath);
+        return;
+    }
+
+    std::error_code error;
+    m_file_size = size_t(std::filesystem::file_size(m_filepath.c_str(), error));
+    if (error)
+    {
+        LOG_ERROR("Could not determine the size of tar archive {}: {}", filepath, error.message());
+        std::fclose(m_file);
+        m_file = nullptr;
+        return;
+    }
+
+    // large sequential reads
+    m_buffer.resize(buffer_size);
+    std::setvbuf(m_file, m_buffer.data(), _IOFBF, m_buffer.size());
+}
+
+tp::tar_reader::~tar_reader()
+{
+    if (m_file)
+        std::fclose(m_file);
+}
+
+bool tp::tar_reader::read_exact(std::byte* data, size_t size)
+{
+    auto const read = std::fread(data, 1, size, m_file);
+    m_position += read;
+    return read == size;
+}
+
+bool tp::tar_reader::skip(size_t size)
+{
+    std::byte discard[tar_block_size];
+    while (size > 0)
+    {
+        auto const n = size < tar_block_size ? size : tar_block_size;
+        if (!read_exact(discard, n))
+            return false;
+        size -= n;
+    }
+    return true;
+}
+
+bool tp::tar_reader::next(cc::string& name, cc::vector<std::byte>& content)
+{
+    if (!m_file)
+        return false;
+
+    cc::string long_name; // from a GNU 'L' or pax 'x' record, applies to the next member
+    std::byte header[tar_block_size];
+
+    while (true)
+    {
+        if (!read_exact(header, tar_block_size))
+        {
+            LOG_ERROR("Tar archive ends without end-of-archive marker: {}", m_filepath);
+            return false;
+        }
+
+        // end of archive: a zero block
+        auto is_zero = true;
+        for (auto b : header)
+            is_zero = is_zero && b == std::byte(0);
+        if (is_zero)
+            return false;
+
+        if (!verify_tar_checksum(header))
+        {
+            LOG_ERROR("Invalid tar header checksum: {}", m_filepath);
+            return false;
+        }
+
+        auto const h = reinterpret_cast<char const*>(header);
+        size_t size = 0;
+        if (!parse_tar_number(h + 124, 12, size))
+        {
+            LOG_ERROR("Invalid tar member size: {}", m_filepath);
+            return false;
+        }
+        auto const type = h[156];
+
+        if (type == 'L' || type == 'x')
+        {
+            cc::vector<std::byte> record;
+            if (!fits(size))
+            {
+                LOG_ERROR("Truncated tar archive: {}", m_filepath);
+                return false;
+            }
+            record.resize(size);
+            if (!read_exact(record.data(), size) || !skip(padded_size(size) - size))
+            {
+                LOG_ERROR("Truncated tar archive: {}", m_filepath);
+                return false;
+            }
+            if (type == 'L')
+                long_name = cc::string(tar_string(reinterpret_cast<char const*>(record.data()), record.size()));
+            else if (auto path = pax_path(record); !path.empty())
+                long_name = cc::move(path);
+            continue;
+        }
+
+        if (type != '0' && type != '\0')
+        {
+            // directories, links, ...
+            if (!skip(padded_size(size)))
+            {
+                LOG_ERROR("Truncated tar archive: {}", m_filepath);
+                return false;
+            }
+            long_name.clear();
+            continue;
+        }
+
+        if (!long_name.empty())
+            name = cc::move(long_name);
+        else
+        {
+            auto const prefix = tar_string(h + 345, 155);
+            name = prefix.empty() ? cc::string(tar_string(h, 100)) : cc::string(prefix) + "/" + tar_string(h, 100);
+        }
+
+        if (!fits(size))
+        {
+            LOG_ERROR("Truncated tar archive: {}", m_filepath);
+            return false;
+        }
+        content.resize(size);
+        if (!read_exact(content.data(), size) || !skip(padded_size(size) - size))
+        {
+            LOG_ERROR("Truncated tar archive: {}", m_filepath);
+            return false;
+        }
+        return true;
+    }
+}
+
+tp::tar_writer::tar_writer(cc::string_view filepath, size_t buffer_size) : m_filepath{filepath}
+{
+    m_file = std::fopen(m_filepath.c_str(), "wb");
+    if (!m_file)
+    {
+        LOG_ERROR("Could not open tar archive for writing: {}", filepath);
+        return;
+    }
+
+    // large sequential writes
+    m_buffer.resize(buffer_size);
+    std::setvbuf(m_file, m_buffer.data(), _IOFBF, m_buffer.size());
+}
+
+tp::tar_writer::~tar_writer() { close(); }
+
+bool tp::tar_writer::write(void const* data, size_t size)
+{
+    m_ok = m_ok && std::fwrite(data, 1, size, m_file) == size;
+    m_size += size;
+    return m_ok;
+}
+
+bool tp::tar_writer::write_header(cc::string_view name, size_t size, char type)
+{
+    char header[tar_block_size] = {};
+    std::memcpy(header, name.data(), tg::min(name.size(), size_t(100)));
+    std::snprintf(header + 100, 8, "%07o", 0644u);
+    std::snprintf(header + 108, 8, "%07o", 0u);
+    std::snprintf(header + 116, 8, "%07o", 0u);
+    std::snprintf(header + 124, 12, "%011llo", static_cast<unsigned long long>(size));
+    std::snprintf(header + 136, 12, "%011o", 0u);
+    header[156] = type;
+    std::memcpy(header + 257, "ustar", 6);
+    std::memcpy(header + 263, "00", 2);
+
+    // the checksum is computed with the checksum field set to spaces
+    std::memset(header + 148, ' ', 8);
+    size_t sum = 0;
+    for (auto const c : header)
+        sum += uint8_t(c);
+    std::snprintf(header + 148, 8, "%06o", unsigned(sum));
+    header[155] = ' ';
+
+    return write(header, tar_block_size);
+}
+
+size_t tp::tar_writer::member_size(size_t name_size, size_t content_size)
+{
+    // pax record: "<length> path=<name>\n", see add
+    auto const pax = name_size > 100 ? tar_block_size + padded_size(name_size + 16) : 0;
+    return pax + tar_block_size + padded_size(content_size);
+}
+
+bool tp::tar_writer::add(cc::string_view name, cc::span<std::byte const> content, size_t* data_offset)
+{
+    if (!m_file)
+        return false;
+
+    if (name.size() > 100)
+    {
+        // "<length> path=<name>\n", the length includes its own digits
+        auto const body = " path=" + cc::string(name) + "\n";
+        auto length = body.size() + 1;
+        while (cc::to_string(length).size() + body.size() != length)
+            ++length;
+        auto const record = cc::to_string(length) + body;
+        auto const padding = padded_size(record.size()) - record.size();
+        char const zeros[tar_block_size] = {};
+        if (!write_header("PaxHeader", record.size(), 'x') || !write(record.data(), record.size()) || !write(zeros, padding))
+            return false;
+    }
+
+    if (!write_header(name, content.size(), '0'))
+        return false;
+    if (data_offset)
+        *data_offset = m_size;
+    char const zeros[tar_block_size] = {};
+    return write(content.data(), content.size()) && write(zeros, padded_size(content.size()) - content.size());
+}
+
+bool tp::tar_writer::close()
+{
+    if (!m_file)
+        return m_ok;
+
+    // end of archive: two zero blocks
+    char const zeros[2 * tar_block_size] = {};
+    write(zeros, sizeof(zeros));
+    m_ok = std::fclose(m_file) == 0 && m_ok;
+    m_file = nullptr;
+    if (!m_ok)
+        LOG_ERROR("Could not write tar archive: {}", m_filepath);
+    return m_ok;
+}
+
+bool tp::write_sequence_tar_shards(cc::span<image_data const> images, cc::string_view prefix, settings const& settings, int worker_count)
+{
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+
+    auto const shard_limit = tg::max(size_t(1), settings.tar_shard_mb) << 20;
+    auto const extension = sequence_file_extension(settings.encoding);
+    auto const count = int(images.size());
+
+    cc::vector<cc::string> names;
+    cc::vector<cc::vector<std::byte>> sequences;
+    cc::vector<int> token_counts;
+    cc::string index = "# shard member id token_count offset size\n";
+
+    auto shard = -1;
+    cc::string shard_name;
+    std::unique_ptr<tar_writer> writer;
+    auto success = true;
+    auto const open_shard = [&]
+    {
+        if (writer)
+            success = writer->close() && success;
+        ++shard;
+        auto const path = cc::string(prefix) + cc::format("-{:06}.tar", shard);
+        writer = std::make_unique<tar_writer>(path);
+        shard_name = cc::string(std::filesystem::path(path.c_str()).filename().string()); // the index is next to the shards
+        success = writer->valid() && success;
+    };
+
+    auto const batch_size = tg::max(1, worker_count * 256);
+    names.resize(batch_size);
+    sequences.resize(batch_size);
+    token_counts.resize(batch_size);
+
+    for (auto batch_begin = 0; batch_begin < count && success; batch_begin += batch_size)
+    {
+        auto const batch_end = tg::min(count, batch_begin + batch_size);
+
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 16)
+        for (auto i = batch_begin; i < batch_end; ++i)
+        {
+            image_data scratch; // decompression target for compressed images
+            auto const& image = images[i].decompressed(scratch);
+            cc::vector<sequence_token> tokens;
+            extract_token_sequence(image, tokens);
+            auto& sequence = sequences[i - batch_begin];
+            encode_token_sequence(tokens, image.current_token_class.width(), sequence, settings.encoding, settings.compression);
+            token_counts[i - batch_begin] = int(tokens.size());
+            names[i - batch_begin] = cc::string(strip_extension(image.filename)) + ".sequence" + extension;
+        }
+
+        // members are appended in image order, a shard is closed before it would exceed the limit (unless it is empty)
+        for (auto i = batch_begin; i < batch_end && success; ++i)
+        {
+            auto const& name = names[i - batch_begin];
+            auto const& sequence = sequences[i - batch_begin];
+            auto const end_of_member = writer ? writer->size() + tar_writer::member_size(name.size(), sequence.size()) + 2 * tar_block_size : 0;
+            if (!writer || (writer->size() > 0 && end_of_member > shard_limit))
+                open_shard();
+
+            size_t offset = 0;
+            success = success && writer->add(name, sequence, &offset);
+            index += cc::format("{} {} {} {} {} {}\n", shard_name, name, images[i].id, token_counts[i - batch_begin], offset, //
+                                sequence.size());
+        }
+    }
+    if (writer)
+        success = writer->close() && success;
+
+    auto const index_bytes = cc::span<std::byte const>(reinterpret_cast<std::byte const*>(index.data()), index.size());
+    success = success && write_file_bytes(cc::string(prefix) + ".index", index_bytes);
+    if (success)
+        LOG("Wrote {} token sequences to {} tar shard(s) at {}", count, shard + 1, prefix);
+    return success;
+}
+
+cc::vector<cc::string> tp::expand_shard_pattern(cc::string_view pattern)
+{
+    auto const open = std::string_view(pattern.data(), pattern.size()).find('{');
+    auto const close = std::string_view(pattern.data(), pattern.size()).find('}');
+    if (open == std::string_view::npos || close == std::string_view::npos || close < open)
+        return {cc::string(pattern)};
+
+    auto const range = pattern.subview(open + 1, close - open - 1);
+    auto const [first_str, last_str_with_dot] = range.split_once("..");
+    int first = 0;
+    int last = 0;
+    if (!cc::from_string(first_str, first) || !cc::from_string(last_str_with_dot, last) || last < first)
+    {
+        LOG_ERROR("Invalid shard pattern: {}", pattern);
+        return {};
+    }
+
+    auto const prefix = pattern.subview(0, open);
+    auto const suffix = pattern.subview(close + 1);
+    auto const width = int(first_str.size()); // zero padding, e.g. {000..099}
+
+    cc::vector<cc::string> files;
+    for (auto i = first; i <= last; ++i)
+    {
+        auto number = cc::to_string(i);
+        while (int(number.size()) < width)
+            number = "0" + number;
+        files.push_back(cc::string(prefix) + number + suffix);
+    }
+    return files;
+}
+
+bool tp::is_tar_input(cc::string_view input) { return input.ends_with(".tar"); }
+
+cc::vector<tp::image_data> tp::read_tar(cc::span<cc::string const> tar_files, int worker_count)
+{
+    if (worker_count <= 0)
+        worker_count = omp_get_max_threads();
+
+    struct member
+    {
+        cc::string filename;
+        int id = -1;
+        cc::vector<std::byte> content;
+    };
+
+    cc::vector<image_data> images;
+
+    // members are read sequentially and parsed in parallel batches
+    auto const batch_size = worker_count * 256;
+    cc::vector<member> batch;
+    auto parse_batch = [&]
+    {
+        auto const first = int(images.size());
+        images.resize(first + batch.size());
+
+#pragma omp parallel for num_threads(worker_count) schedule(dynamic, 16)
+        for (auto i = 0; i < int(batch.size()); ++i)
+        {
+            auto& m = batch[i];
+            auto image = parse_token_bin_data(m.content, m.filename);
+            if (image.pixel_count() > 0)
+                images[first + i] = image_data(m.filename, m.id, cc::move(image));
+        }
+        batch.clear();
+    };
+
+    cc::string name;
+    cc::vector<std::byte> content;
+    for (auto const& tar_file : tar_files)
+    {
+        tar_reader reader(tar_file);
+        while (reader.next(name, content))
+        {
+            auto const slash = std::string_view(name.data(), name.size()).rfind('/');
+            auto const filename = slash == std::string_view::npos ? cc::string_view(name) : cc::string_view(name).subview(slash + 1);
+
+            if (!filename.ends_with(".dat"))
+            {
+                LOG_WARN("Skipping non-.dat member: {}:{}", tar_file, name);
+                continue;
+            }
+
+            int id = -1;
+            if (!parse_image_id(strip_extension(filename), id))
+            {
+                LOG_WARN("Member does not have the expected file-format: {}:{}", tar_file, name);
+                continue;
+            }
+
+            batch.push_back({cc::string(filename), id, cc::move(content)});
+            content = {};
+            if (int(batch.size()) >= batch_size)
+                parse_batch();
+        }
+    }
+    parse_batch();
+
+    remove_empty_images(images); // malformed members are already reported
+    return images;
+}
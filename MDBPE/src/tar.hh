@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+
+#include <clean-core/span.hh>
+#include <clean-core/string.hh>
+#include <clean-core/string_view.hh>
+#include <clean-core/vector.hh>
+
+#include "image_data.hh"
+#include "settings.hh"
+
+namespace tp
+{
+/// sequential reader for tar archives (ustar, GNU long names and pax path records)
+/// reads the archive front to back in large blocks, without seeking
+struct tar_reader
+{
+public:
+    explicit tar_reader(cc::string_view filepath, size_t buffer_size = size_t(8) << 20);
+    ~tar_reader();
+
+    tar_reader(tar_reader const&) = delete;
+    tar_reader& operator=(tar_reader const&) = delete;
+
+    bool valid() const { return m_file != nullptr; }
+
+    /// reads the next regular file member into 'name' and 'content'
+    /// returns false at the end of the archive or on a malformed archive (which is reported)
+    bool next(cc::string& name, cc::vector<std::byte>& content);
+
+private:
+    bool read_exact(std::byte* data, size_t size);
+    bool skip(size_t size);
+
+    /// true if 'size' bytes of content can still follow, sizes from headers are checked before anything is allocated for them
+    bool fits(size_t size) const { return size <= m_file_size - m_position; }
+
+    cc::string m_filepath;
+    std::FILE* m_file = nullptr;
+    cc::vector<char> m_buffer; // stdio buffer
+    size_t m_file_size = 0;
+    size_t m_position = 0; // bytes read so far
+};
+
+/// sequential writer for ustar archives, names longer than 100 bytes get a pax path record
+/// members are appended with large buffered writes, nothing is seeked
+struct tar_writer
+{
+public:
+    explicit tar_writer(cc::string_view filepath, size_t buffer_size = size_t(8) << 20);
+    ~tar_writer();
+
+    tar_writer(tar_writer const&) = delete;
+    tar_writer& operator=(tar_writer const&) = delete;
+
+    bool valid() const { return m_file != nullptr; }
+
+    /// appends a regular file member, 'data_offset' receives the position of its content in the archive
+    bool add(cc::string_view name, cc::span<std::byte const> content, size_t* data_offset = nullptr);
+
+    /// writes the end-of-archive marker and closes the archive, reports errors
+    bool close();
+
+    /// bytes written so far
+    size_t size() const { return m_size; }
+
+    /// bytes a member with the given name and content size takes in the archive
+    static size_t member_size(size_t name_size, size_t content_size);
+
+private:
+    bool write(void const* data, size_t size);
+    bool write_header(cc::string_view name, size_t size, char type);
+
+    cc::string m_filepath;
+    std::FILE* m_file = nullptr;
+    cc::vector<char> m_buffer; // stdio buffer
+    size_t m_size = 0;
+    bool m_ok = true;
+};
+
+/// writes the token sequences of all images as members of WebDataset-style tar shards "{prefix}-{shard:06}.tar"
+/// a member is "{name}.sequence.dat" (".cdat" for compact sequences), a new shard starts before settings.tar_shard_mb is exceeded
+/// "{prefix}.index" lists one "<shard> <member> <id> <token count> <offset> <size>" line per sequence, offset and size locate the
+/// member content inside the shard. sequences are encoded on 'worker_count' threads (0 = one per core) and written sequentially
+bool write_sequence_tar_shards(cc::span<image_data const> images, cc::string_view prefix, settings const& settings = {}, int worker_count = 0);
+
+/// expands a WebDataset-style shard pattern, e.g. "train-{000..099}.tar" to train-000.tar ... train-099.tar
+/// patterns without braces are returned as they are
+cc::vector<cc::string> expand_shard_pattern(cc::string_view pattern);
+
+/// returns true if the input is a tar archive or a shard pattern of tar archives
+bool is_tar_input(cc::string_view input);
+
+/// streams the .dat members out of one or more tar archives, in archive order
+/// ids are parsed from the member names like read_folder does for filenames, parsing runs on 'worker_count' threads
+cc::vector<image_data> read_tar(cc::span<cc::string const> tar_files, int worker_count = 0);
+}
@@ -0,0 +1,335 @@
+#include "tensor_io.hh"
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+#include <clean-core/format.hh>
+#include <clean-core/from_string.hh>
+
+#include <babel-serializer/file.hh>
+
+#include <rich-log/log.hh>
+
+#include "util.hh"
+
+namespace
+{
+using mapped_file = babel::file::memory_mapped_file<std::byte const>;
+
+/// element layout of an N x H x W tensor inside a file
+struct tensor_layout
+{
+    int count = 0;
+    int height = 0;
+    int width = 0;
+    int element_bytes = 0; // 1, 2 or 4
+    bool is_signed = false;
+    bool big_endian = false;
+    size_t payload_offset = 0;
+};
+
+int read_element(std::byte const* src, tensor_layout const& layout)
+{
+    uint32_t v = 0;
+    for (auto b = 0; b < layout.element_bytes; ++b)
+    {
+        auto const shift = layout.big_endian ? 8 * (layout.element_bytes - 1 - b) : 8 * b;
+        v |= uint32_t(uint8_t(src[b])) << shift;
+    }
+    if (layout.is_signed && layout.element_bytes < 4 && (v >> (8 * layout.element_bytes - 1)) & 1)
+        v |= ~uint32_t(0) << (8 * layout.element_bytes); // sign extension
+    return int(v);
+}
+
+cc::vector<tp::image_data> images_from_tensor(
+    std::shared_ptr<mapped_file> file, tensor_layout const& layout, bool memory_map, int class_count, cc::string_view filepath)
+{
+    auto const data = cc::span<std::byte const>(file->data(), file->size());
+    auto const pixels = size_t(layout.width) * size_t(layout.height);
+    auto const plane_bytes = pixels * size_t(layout.element_bytes);
+    auto const expected_size = layout.payload_offset + size_t(layout.count) * plane_bytes;
+    if (data.size() < expected_size)
+    {
+        LOG_ERROR("File has {} bytes, but its header requires {}: {}", data.size(), expected_size, filepath);
+        return {};
+    }
+
+    auto const extents = tg::isize2(layout.width, layout.height);
+    cc::vector<tp::image_data> images;
+    images.resize(layout.count);
+
+    // image_data can read little-endian planes lazily (bytes are always fine), everything else is converted now
+    // mapped planes are still scanned once, so invalid classes are reported here and not in the middle of training
+    auto const mappable = !layout.big_endian || layout.element_bytes == 1;
+    auto const map_planes = memory_map && mappable;
+
+    auto negative_count = 0;
+    auto too_large_count = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : negative_count, too_large_count)
+    for (auto i = 0; i < layout.count; ++i)
+    {
+        auto const src = data.data() + layout.payload_offset + i * plane_bytes;
+        img::image<int> plane;
+        if (!map_planes)
+            plane.resize(extents);
+        for (size_t p = 0; p < pixels; ++p)
+        {
+            auto const c = read_element(src + p * layout.element_bytes, layout);
+            negative_count += c < 0;
+            too_large_count += class_count > 0 && c >= class_count;
+            if (!map_planes)
+                plane.data_ptr()[p] = c;
+        }
+        if (map_planes)
+            images[i] = tp::image_data(cc::format("{}.dat", i), i, extents, src, layout.element_bytes, file, layout.is_signed);
+        else
+            images[i] = tp::image_data(cc::format("{}.dat", i), i, cc::move(plane));
+    }
+
+    if (negative_count > 0)
+    {
+        LOG_ERROR("Tensor contains {} negative classes: {}", negative_count, filepath);
+        return {};
+    }
+    if (too_large_count > 0)
+    {
+        LOG_ERROR("Tensor contains {} classes outside of [0, {}): {}", too_large_count, class_count, filepath);
+        return {};
+    }
+    return images;
+}
+
+// parses the python dict literal of a .npy header, e.g. {'descr': '<i4', 'fortran_order': False, 'shape': (100, 12, 12), }
+bool parse_npy_header(cc::span<std::byte const> data, tensor_layout& layout, cc::string_view filepath)
+{
+    if (data.size() < 10 || std::memcmp(data.data(), "\x93NUMPY", 6) != 0)
+    {
+        LOG_ERROR("Not a .npy file: {}", filepath);
+        return false;
+    }
+
+    auto const major = int(data[6]);
+    size_t header_len = 0;
+    size_t header_offset = 0;
+    if (major == 1)
+    {
+        header_len = size_t(uint8_t(data[8])) | size_t(uint8_t(data[9])) << 8;
+        header_offset = 10;
+    }
+    else if ((major == 2 || major == 3) && data.size() >= 12)
+    {
+        for (auto b = 0; b < 4; ++b)
+            header_len |= size_t(uint8_t(data[8 + b])) << (8 * b);
+        header_offset = 12;
+    }
+    else
+    {
+        LOG_ERROR("Unsupported .npy version {}: {}", major, filepath);
+        return false;
+    }
+    if (data.size() < header_offset + header_len)
+    {
+        LOG_ERROR("Truncated .npy header: {}", filepath);
+        return false;
+    }
+
+    auto const header = cc::string_view(reinterpret_cast<char const*>(data.data()) + header_offset, header_len);
+    layout.payload_offset = header_offset + header_len;
+
+    // value after a key, up to (excluding) the given terminator
+    auto value_of = [&](cc::string_view key, char open, char close) -> cc::string_view
+    {
+        auto const key_pos = std::string_view(header.data(), header.size()).find(std::string_view(key.data(), key.size()));
+        if (key_pos == std::string_view::npos)
+            return {};
+        auto const rest = header.subview(key_pos + key.size());
+        auto const begin = std::string_view(rest.data(), rest.size()).find(open);
+        if (begin == std::string_view::npos)
+            return {};
+        auto const end = std::string_view(rest.data(), rest.size()).find(close, begin + 1);
+        if (end == std::string_view::npos)
+            return {};
+        return rest.subview(begin + 1, end - begin - 1);
+    };
+
+    auto const descr = value_of("'descr'", '\'', '\'');
+    auto const shape = value_of("'shape'", '(', ')');
+
+    if (std::string_view(header.data(), header.size()).find("'fortran_order': True") != std::string_view::npos)
+    {
+        LOG_ERROR("Fortran-order .npy files are not supported: {}", filepath);
+        return false;
+    }
+
+    if (descr.size() != 3)
+    {
+        LOG_ERROR("Unsupported .npy dtype '{}': {}", descr, filepath);
+        return false;
+    }
+    auto const byte_order = descr[0];
+    auto const kind = descr[1];
+    layout.element_bytes = descr[2] - '0';
+    layout.is_signed = kind == 'i';
+    layout.big_endian = byte_order == '>' || (byte_order == '=' && std::endian::native == std::endian::big);
+    if ((kind != 'i' && kind != 'u') || (layout.element_bytes != 1 && layout.element_bytes != 2 && layout.element_bytes != 4)
+        || (kind == 'u' && layout.element_bytes == 4))
+    {
+        LOG_ERROR("Unsupported .npy dtype '{}' (expected int8/16/32 or uint8/16): {}", descr, filepath);
+        return false;
+    }
+
+    cc::vector<int> dims;
+    for (auto part : shape.split(','))
+    {
+        part = part.trim();
+        if (part.empty())
+            continue;
+        int d = 0;
+        if (!cc::from_string(part, d))
+        {
+            LOG_ERROR("Invalid .npy shape '({})': {}", shape, filepath);
+            return false;
+        }
+        dims.push_back(d);
+    }
+    if (dims.size() == 2)
+        dims.insert_at(0, 1); // a single image
+    if (dims.size() != 3)
+    {
+        LOG_ERROR("Expected an N x H x W tensor, got shape ({}): {}", shape, filepath);
+        return false;
+    }
+
+    layout.count = dims[0];
+    layout.height = dims[1];
+    layout.width = dims[2];
+    return true;
+}
+
+int32_t read_be_i32(std::byte const* data)
+{
+    int32_t v;
+    std::memcpy(&v, data, sizeof(v));
+    if constexpr (std::endian::native == std::endian::little)
+        v = tp::byteswap(v);
+    return v;
+}
+
+// IDX: two zero bytes, a type code, the number of dimensions, then big-endian int32 dimensions
+bool parse_idx_header(cc::span<std::byte const> data, tensor_layout& layout, cc::string_view filepath)
+{
+    if (data.size() < 4 || data[0] != std::byte(0) || data[1] != std::byte(0))
+    {
+        LOG_ERROR("Not an IDX file: {}", filepath);
+        return false;
+    }
+
+    auto const type = int(data[2]);
+    auto const dim_count = int(data[3]);
+    switch (type)
+    {
+    case 0x08: layout.element_bytes = 1, layout.is_signed = false; break;
+    case 0x09: layout.element_bytes = 1, layout.is_signed = true; break;
+    case 0x0B: layout.element_bytes = 2, layout.is_signed = true; break;
+    case 0x0C: layout.element_bytes = 4, layout.is_signed = true; break;
+    default: LOG_ERROR("Unsupported IDX element type {} (expected an integer type): {}", type, filepath); return false;
+    }
+    layout.big_endian = true;
+
+    if ((dim_count != 2 && dim_count != 3) || data.size() < 4 + 4 * size_t(dim_count))
+    {
+        LOG_ERROR("Expected an N x H x W IDX tensor, got {} dimensions: {}", dim_count, filepath);
+        return false;
+    }
+
+    int dims[3] = {1, 0, 0};
+    for (auto d = 0; d < dim_count; ++d)
+        dims[3 - dim_count + d] = read_be_i32(data.data() + 4 + 4 * d);
+
+    layout.count = dims[0];
+    layout.height = dims[1];
+    layout.width = dims[2];
+    layout.payload_offset = 4 + 4 * size_t(dim_count);
+    return true;
+}
+
+template <class ParseHeaderF>
+cc::vector<tp::image_data> read_tensor_file(cc::string_view filepath, bool memory_map, int class_count, ParseHeaderF&& parse_header)
+{
+    if (!babel::file::exists(filepath))
+    {
+        LOG_ERROR("Input file does not exist: {}", filepath);
+        return {};
+    }
+
+    auto file = std::make_shared<mapped_file>(filepath);
+    tensor_layout layout;
+    if (!parse_header(cc::span<std::byte const>(file->data(), file->size()), layout, filepath))
+        return {};
+
+    if (layout.count < 0 || layout.width <= 0 || layout.height <= 0)
+    {
+        LOG_ERROR("Invalid tensor shape {} x {} x {}: {}", layout.count, layout.height, layout.width, filepath);
+        return {};
+    }
+
+    return images_from_tensor(cc::move(file), layout, memory_map, class_count, filepath);
+}
+}
+
+cc::vector<tp::image_data> tp::read_npy(cc::string_view filepath, bool memory_map, int class_count)
+{
+    return read_tensor_file(filepath, memory_map, class_count, parse_npy_header);
+}
+
+cc::vector<tp::image_data> tp::read_idx(cc::string_view filepath, bool memory_map, int class_count)
+{
+    return read_tensor_file(filepath, memory_map, class_count, parse_idx_header);
+}
+
+bool tp::is_npy_input(cc::string_view input) { return input.ends_with(".npy"); }
+
+bool tp::is_idx_input(cc::string_view input) { return input.ends_with("-ubyte") || input.ends_with(".idx"); }
+
+int tp::tensor_image_count(cc::string_view filepath)
+{
+    if (!babel::file::exists(filepath))
+        return -1;
+
+    auto const file = mapped_file(filepath);
+    auto const data = cc::span<std::byte const>(file.data(), file.size());
+    tensor_layout layout;
+    auto const valid = is_npy_input(filepath) ? parse_npy_header(data, layout, filepath) : parse_idx_header(data, layout, filepath);
+    return valid ? layout.count : -1;
+}
+
+cc::vector<std::byte> tp::make_npy_header(cc::string_view descr, cc::span<int64_t const> shape)
+{
+    // python tuple syntax: "(N, L)", but "(N,)" for a single dimension
+    cc::string dims;
+    for (size_t i = 0; i < shape.size(); ++i)
+        dims += cc::format(i == 0 ? "{}" : ", {}", shape[i]);
+    if (shape.size() == 1)
+        dims += ",";
+    auto const dict = "{'descr': '" + cc::string(descr) + "', 'fortran_order': False, 'shape': (" + dims + "), }";
+
+    // magic, version 1.0, uint16 header length, dict padded with spaces and terminated by a newline
+    auto const prefix_bytes = size_t(10);
+    auto header_len = dict.size() + 1;
+    header_len += (64 - (prefix_bytes + header_len) % 64) % 64;
+
+    cc::vector<std::byte> header;
+    header.push_back_range(cc::span<std::byte const>(reinterpret_cast<std::byte const*>("\x93NUMPY"), 6));
+    header.push_back(std::byte(1));
+    header.push_back(std::byte(0));
+    header.push_back(std::byte(header_len & 0xFF));
+    header.push_back(std::byte(header_len >> 8));
+    header.push_back_range(cc::span<std::byte const>(reinterpret_cast<std::byte const*>(dict.data()), dict.size()));
+    while (header.size() < prefix_bytes + header_len - 1)
+        header.push_back(std::byte(' '));
+    header.push_back(std::byte('\n'));
+    return header;
+}
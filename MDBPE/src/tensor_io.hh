@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <clean-core/span.hh>
+#include <clean-core/string_view.hh>
+#include <clean-core/vector.hh>
+
+#include "image_data.hh"
+
+namespace tp
+{
+/// reads an N x H x W integer tensor from a .npy file (int8/16/32 or uint8/16, C-order), image ids are the array indices
+/// with 'memory_map', little-endian tensors are mapped and the images read their planes lazily (see image_data)
+/// negative classes and, if 'class_count' is set, classes >= class_count are reported and nothing is returned
+cc::vector<image_data> read_npy(cc::string_view filepath, bool memory_map, int class_count = 0);
+
+/// reads an N x H x W tensor from an MNIST IDX file (unsigned/signed byte, short or int), image ids are the array indices
+/// with 'memory_map', byte tensors are mapped and the images read their planes lazily. classes are checked like for read_npy
+cc::vector<image_data> read_idx(cc::string_view filepath, bool memory_map, int class_count = 0);
+
+/// returns true if the input path looks like a .npy or IDX file
+bool is_npy_input(cc::string_view input);
+bool is_idx_input(cc::string_view input);
+
+/// builds a version 1.0 .npy header for a C-order array, e.g. descr "<i4" and shape {N, L}
+/// the header is padded to a multiple of 64 bytes, so the payload can be appended directly
+cc::vector<std::byte> make_npy_header(cc::string_view descr, cc::span<int64_t const> shape);
+
+/// reads only the header of a .npy or IDX file and returns the number of images (-1 on error)
+int tensor_image_count(cc::string_view filepath);
+}
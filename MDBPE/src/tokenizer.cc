@@ -14,59 +14,176 @@
 
 #include <cpp-utils/filesystem.hh>
 
+#include "contact_sheet.hh"
 #include "io.hh"
+#include "memory_plan.hh"
+#include "padded_export.hh"
 #include "rule.hh"
+#include "sequence_file.hh"
+#include "sequence_writer.hh"
+#include "tar.hh"
 #include "util.hh"
+#include "vocabulary.hh"
 
-tp::constellation tp::get_most_common_constellation(cc::span<image_data const> images)
+namespace
 {
-    cc::map<constellation, int> constellation_count;
+// creates transcribed_data/ and tokens/ in the output folder, and the sequence folders if sequences are written as files
+void create_output_folders(cc::string const& output_folder,
+                           cc::span<tp::image_data const> images,
+                           int output_folder_count,
+                           tp::settings const& settings)
+{
+    auto const transcribed_data_folder = output_folder + "transcribed_data/";
+    util::make_directories(transcribed_data_folder);
+    util::make_directories(output_folder + "tokens/");
+    if (settings.sequences == tp::sequence_output::files)
+        tp::create_sequence_folders(images, transcribed_data_folder, output_folder_count, settings.per_image_folders);
+}
 
-    for (auto& image : images)
-    {
-        auto const width = image.initial_token_class().width();
-        auto const height = image.initial_token_class().height();
+// writes the token sequences of all images into transcribed_data/ in the configured output format
+void write_sequences(cc::span<tp::image_data const> images, cc::string const& output_folder, int output_folder_count, tp::settings const& settings)
+{
+    auto const transcribed_data_folder = output_folder + "transcribed_data/";
+    if (settings.sequences == tp::sequence_output::indexed)
+        tp::write_sequence_files(images, transcribed_data_folder + "sequences", settings);
+    else if (settings.sequences == tp::sequence_output::padded)
+        tp::write_padded_sequences(images, transcribed_data_folder + "sequences", settings);
+    else if (settings.sequences == tp::sequence_output::tar)
+        tp::write_sequence_tar_shards(images, transcribed_data_folder + "sequences", settings);
+    else
+        tp::write_token_sequences(images, transcribed_data_folder, output_folder_count, settings);
+}
 
-        auto const& token_class = image.current_token_class;
-        auto const& token_id = image.current_token_id;
+// writes token shapes, rules and the vocabulary file of the rules created so far
+void write_vocabulary_files(cc::span<tp::rule const> rules, cc::span<tp::token_data const> tokens, cc::string const& output_folder, int class_count)
+{
+    LOG("Output token shapes");
 
-        cc::set<cc::pair<tg::ipos2, tg::ipos2>> used; // must be per image!
+    tp::write_token_shapes(tokens, output_folder + "tokens/");
 
-        for (auto y = 0; y < height; ++y)
-            for (auto x = 0; x < width; ++x)
-                for (auto dir : {tg::ivec2(0, 1), tg::ivec2(1, 0)})
-                {
-                    auto const coords = tg::ipos2(x, y);
-                    auto const neighbor_coords = coords + dir;
+    LOG("Output token rules");
 
-                    if (!token_id.contains(neighbor_coords)) // bounds check
-                        continue;
+    tp::write_rules(rules, output_folder);
 
-                    auto const current_token_id = token_id[coords];
-                    auto const neighbor_token_id = token_id[neighbor_coords];
+    LOG("Output vocabulary");
 
-                    // skip if they're the same unique ID (=we can't merge a single large token with itself)
-                    if (current_token_id == neighbor_token_id)
-                        continue;
+    tp::write_vocabulary(output_folder + "vocabulary.vocab", rules, tokens, class_count);
+}
 
-                    auto const current_ancor = image.token_ancor[current_token_id];
-                    auto const neighbor_ancor = image.token_ancor[neighbor_token_id];
+// calls 'f' with the constellation of every pair of neighbouring tokens in the image, each pair of ancors once
+template <class F>
+void for_each_constellation(tp::image_data const& image, F&& f)
+{
+    auto const width = image.initial_token_class().width();
+    auto const height = image.initial_token_class().height();
 
-                    // only do every centre pair once - if we already looked at two unique tokens, we don't need to look at them again (for this one
-                    // image):   two unique tokens at specific positions are only counted once
-                    // todo: only insert ancor after sorting, i.e. by token id,
-                    if (used.contains({current_ancor, neighbor_ancor}) || used.contains({neighbor_ancor, current_ancor}))
-                        continue;
+    auto const& token_class = image.current_token_class;
+    auto const& token_id = image.current_token_id;
 
-                    used.add({current_ancor, neighbor_ancor});
+    cc::set<cc::pair<tg::ipos2, tg::ipos2>> used; // must be per image!
 
-                    auto const offset = neighbor_ancor - current_ancor;
+    for (auto y = 0; y < height; ++y)
+        for (auto x = 0; x < width; ++x)
+            for (auto dir : {tg::ivec2(0, 1), tg::ivec2(1, 0)})
+            {
+                auto const coords = tg::ipos2(x, y);
+                auto const neighbor_coords = coords + dir;
 
-                    auto const current_class = token_class[coords];
-                    auto const neighbor_class = token_class[neighbor_coords];
+                if (!token_id.contains(neighbor_coords)) // bounds check
+                    continue;
 
-                    constellation_count[{current_class, neighbor_class, offset}] += 1;
-                }
+                auto const current_token_id = token_id[coords];
+                auto const neighbor_token_id = token_id[neighbor_coords];
+
+                // skip if they're the same unique ID (=we can't merge a single large token with itself)
+                if (current_token_id == neighbor_token_id)
+                    continue;
+
+                auto const current_ancor = image.token_ancor[current_token_id];
+                auto const neighbor_ancor = image.token_ancor[neighbor_token_id];
+
+                // only do every centre pair once - if we already looked at two unique tokens, we don't need to look at them again (for this one
+                // image):   two unique tokens at specific positions are only counted once
+                // todo: only insert ancor after sorting, i.e. by token id,
+                if (used.contains({current_ancor, neighbor_ancor}) || used.contains({neighbor_ancor, current_ancor}))
+                    continue;
+
+                used.add({current_ancor, neighbor_ancor});
+
+                auto const offset = neighbor_ancor - current_ancor;
+
+                auto const current_class = token_class[coords];
+                auto const neighbor_class = token_class[neighbor_coords];
+
+                f(tp::constellation{current_class, neighbor_class, offset});
+            }
+}
+
+// true if 'rule' applies to the token whose ancor is at 'coords' (as source token) and its target token
+bool rule_applies_at(tp::constellation const& rule, tp::image_data const& image, tg::ipos2 coords)
+{
+    if (image.current_token_class[coords] != rule.source_class_id) // not the right token to apply the rule
+        return false;
+
+    if (image.token_ancor[image.current_token_id[coords]] != coords) // only apply rule to token ancors
+        return false;
+
+    auto const other_token_coords = coords + rule.ancor_offset;
+    if (!image.initial_token_class().contains(other_token_coords)) // bounds check
+        return false;
+
+    if (image.current_token_class[other_token_coords] != rule.target_class_id) // not the right token to apply the rule
+        return false;
+
+    return image.token_ancor[image.current_token_id[other_token_coords]] == other_token_coords; // the correct ancor
+}
+
+// true if 'rule' applies anywhere in the image, i.e. apply_rule would change it
+bool rule_applies(tp::constellation const& rule, tp::image_data const& image)
+{
+    auto const width = image.initial_token_class().width();
+    auto const height = image.initial_token_class().height();
+    for (auto y = 0; y < height; ++y)
+        for (auto x = 0; x < width; ++x)
+            if (rule_applies_at(rule, image, tg::ipos2(x, y)))
+                return true;
+    return false;
+}
+
+// constellation counts of a single image, in the order they are first seen
+cc::vector<tp::counted_constellation> count_constellations(tp::image_data const& image)
+{
+    cc::vector<tp::counted_constellation> counts;
+    cc::map<tp::constellation, int> index;
+    for_each_constellation(image,
+                           [&](tp::constellation const& c)
+                           {
+                               auto& i = index.get_or_create(c, [&] { return int(counts.size()); });
+                               if (i == int(counts.size()))
+                                   counts.push_back({c, 0});
+                               counts[i].count += 1;
+                           });
+    return counts;
+}
+}
+
+tp::constellation tp::get_most_common_constellation(cc::span<image_data const> images)
+{
+    cc::map<constellation, int> constellation_count;
+    image_data scratch; // decompression target for mapped images
+
+    for (auto& stored_image : images)
+    {
+        // compressed images are inactive, their counts did not change since they were compressed
+        // (the cache is in the order of first occurrence, so the table is filled in the same order as by counting)
+        if (stored_image.is_compressed())
+        {
+            for (auto const& c : stored_image.cached_constellations())
+                constellation_count[c.constellation] += c.count;
+            continue;
+        }
+
+        for_each_constellation(stored_image.decompressed(scratch), [&](constellation const& c) { constellation_count[c] += 1; });
     }
 
     // find constellation with maximal occurrances
@@ -148,51 +265,44 @@ tp::token_data tp::combine_tokens(constellation const& rule, cc::span<token_data
 }
 
 
-void tp::apply_rule(rule const& rule, token_data const& new_token, cc::span<image_data> images)
+void tp::apply_rule(rule const& rule, token_data const& new_token, cc::span<image_data> images, bool compress_inactive)
 {
     auto const offset = rule.constellation.ancor_offset;
     auto keep_token_a_ancor = !(offset.y < 0 || (offset.y == 0 && offset.x < 0));
 
+    image_data scratch; // decompression target for the test of compressed images
+
     auto const n_images = images.size();
     // #pragma omp parallel for // does not improve stuff :(
     for (size_t i = 0; i < n_images; ++i)
     {
         auto& image = images[i];
 
+        // the class summary of compressed images tells us if the rule can apply at all
+        if (!image.might_contain(rule.constellation.source_class_id, rule.constellation.target_class_id))
+            continue;
+
+        // images with both classes often lack the constellation, so compressed images are tested on a scratch copy first
+        // a miss leaves them compressed with their cached counts, instead of decompressing, recounting and recompressing them
+        if (image.is_compressed() && !rule_applies(rule.constellation, image.decompressed(scratch)))
+            continue;
+        image.decompress();
+
         auto const width = image.initial_token_class().width();
         auto const height = image.initial_token_class().height();
+        auto const token_count_before = image.max_token_id();
 
         for (auto y = 0; y < height; ++y)
             for (auto x = 0; x < width; ++x)
             {
                 auto const coords = tg::ipos2(x, y);
-
-                auto const current_token_class = image.current_token_class[coords];
-                if (current_token_class != rule.constellation.source_class_id) // not the right token to apply the rule
-                    continue;
-
-                auto const current_token_ancor = image.token_ancor[image.current_token_id[coords]];
-
-                if (coords != current_token_ancor) // only apply rule to token ancors
-                    continue;
-
-                auto const other_token_coords = coords + rule.constellation.ancor_offset;
-
-                if (!image.initial_token_class().contains(other_token_coords)) // bounds check
-                    continue;
-
-                auto const other_token_class = image.current_token_class[other_token_coords];
-                if (other_token_class != rule.constellation.target_class_id) // not the right token to apply the rule
-                    continue;
-
-                auto const other_token_ancor = image.token_ancor[image.current_token_id[other_token_coords]];
-                if (other_token_ancor != other_token_coords) // not the correct ancor
+                if (!rule_applies_at(rule.constellation, image, coords))
                     continue;
 
                 // now: correct token classes, and correct ancors, therefore apply rule!
                 // do so relative to the correct ancor
 
-                auto const new_ancor = keep_token_a_ancor ? current_token_ancor : other_token_ancor;
+                auto const new_ancor = keep_token_a_ancor ? coords : coords + rule.constellation.ancor_offset;
                 auto const new_id = image.next_token_id();
                 image.token_ancor.push_back(new_ancor);
                 for (auto const p : new_token.positions)
@@ -205,10 +315,51 @@ void tp::apply_rule(rule const& rule, token_data const& new_token, cc::span<imag
                     image.current_token_id[new_coords] = new_id;
                 }
             }
+
+        // the rule did not change anything: image is inactive, keep it compressed until a rule might apply again
+        // its constellation counts are cached, so counting does not decompress it every iteration
+        if (compress_inactive && image.max_token_id() == token_count_before)
+            image.compress(count_constellations(image));
     }
 }
 
-void tp::tokenize(int token_max, int tokens_to_create, tg::isize2 const& image_size, cc::string input_folder, cc::string output_folder, int output_folder_count)
+bool tp::learn_rule(cc::vector<rule>& rules, cc::vector<token_data>& tokens, cc::span<image_data> images, bool compress_inactive)
+{
+    auto const max_constellation = get_most_common_constellation(images);
+    if (max_constellation.source_class_id < 0)
+        return false;
+
+    auto new_token = combine_tokens(max_constellation, tokens);
+    auto new_rule = rule{max_constellation, int(tokens.size())};
+    rules.push_back(new_rule);
+    tokens.push_back(new_token);
+    apply_rule(new_rule, new_token, images, compress_inactive);
+    return true;
+}
+
+tp::vocabulary tp::train_vocabulary(cc::span<image_data> images, int class_count, int tokens_to_create, bool compress_inactive)
+{
+    vocabulary result;
+    result.class_count = class_count;
+    for (auto i = 0; i < class_count; ++i)
+        result.tokens.push_back({{tg::ipos2(0, 0)}, {i}, i});
+
+    for (auto iteration = 0; iteration < tokens_to_create; ++iteration)
+        if (!learn_rule(result.rules, result.tokens, images, compress_inactive))
+        {
+            LOG_WARN("No constellation left after {} of {} tokens, the vocabulary is complete", iteration, tokens_to_create);
+            break;
+        }
+    return result;
+}
+
+void tp::tokenize(int token_max,
+                  int tokens_to_create,
+                  tg::isize2 const& image_size,
+                  cc::string input_folder,
+                  cc::string output_folder,
+                  int output_folder_count,
+                  settings const& settings)
 {
     LOG("Tokenize");
 
@@ -217,23 +368,34 @@ void tp::tokenize(int token_max, int tokens_to_create, tg::isize2 const& image_s
     auto const colors_to_create = tg::max(token_max + tokens_to_create + 1, 2 * image_size.width * image_size.height);
     auto class_colors = generate_colors(colors_to_create);
 
+    if (settings.memory_budget_mb > 0)
+    {
+        LOG("Plan memory");
+        auto image_count = 0;
+        size_t max_file_size = 0;
+        stat_input(input_folder, image_count, max_file_size, settings.raster_input);
+        auto const batch_size = read_batch_size(settings.read_worker_count, settings.read_io_depth);
+        auto const plan = plan_memory(image_count, image_size, token_max, tokens_to_create, max_file_size, batch_size);
+        if (!check_memory_budget(plan, settings.memory_budget_mb << 20, image_size, token_max, tokens_to_create, max_file_size, batch_size))
+            return;
+    }
+
     LOG("Read input data");
-    auto image_data = read_folder(input_folder);
+    auto image_data = read_input(input_folder, settings, token_max + 1);
 
     // not necessary, but nice for debugging purposes:
     // cc::sort(image_data, [](auto const& a, auto const& b) { return a.id < b.id; });
 
     // output folders
     LOG("Create output folders");
-    auto const transcribed_data_folder = output_folder + "transcribed_data/";
-    util::make_directories(transcribed_data_folder);
-    auto const token_data_folder = output_folder + "tokens/";
-    util::make_directories(token_data_folder);
-    for (auto const& image : image_data)
-    {
-        auto const folder = transcribed_data_folder + cc::format("{:06}/{:06}/", image.id % output_folder_count, image.id);
-        util::make_directories(folder);
-    }
+    create_output_folders(output_folder, image_data, output_folder_count, settings);
+
+    cc::set<int> checkpoints;
+    for (auto const size : settings.checkpoint_sizes)
+        if (size > 0 && size < tokens_to_create)
+            checkpoints.add(size);
+        else
+            LOG_WARN("Ignoring checkpoint size {}, it has to be in [1, {}) (the full vocabulary is the regular output)", size, tokens_to_create);
 
     LOG("Initialize data");
     // global data:
@@ -246,8 +408,9 @@ void tp::tokenize(int token_max, int tokens_to_create, tg::isize2 const& image_s
         tokens.push_back({{tg::ipos2(0, 0)}, {i}, i});
     }
 
-    // output debug images
-    // write_images(cc::span(image_data).subspan(0, 1), transcribed_data_folder, -1,output_folder_count, class_colors);
+    // debug contact sheets, no-op unless settings.debug_image_stride is set
+    contact_sheet_writer debug_sheets(output_folder + "debug/", class_colors, settings);
+    debug_sheets.render(image_data, -1);
 
     // ========================================= Main Algorithm =========================================
 
@@ -258,70 +421,114 @@ void tp::tokenize(int token_max, int tokens_to_create, tg::isize2 const& image_s
     {
         LOG("Iteration {} of {}", iteration + 1, tokens_to_create);
 
-        auto const max_constellation = get_most_common_constellation(image_data);
-        auto new_token = combine_tokens(max_constellation, tokens);
-        auto new_rule = rule{max_constellation, int(tokens.size())};
-        rules.push_back(new_rule);
-        tokens.push_back(new_token);
-        apply_rule(new_rule, new_token, image_data);
+        if (!learn_rule(rules, tokens, image_data, settings.compress_inactive_images))
+        {
+            LOG_WARN("No constellation left after {} of {} tokens, the vocabulary is complete", iteration, tokens_to_create);
+            break;
+        }
+
+        // the rules are learned greedily, so the first n rules are exactly the vocabulary a run with n tokens would create
+        auto const created = iteration + 1;
+        if (checkpoints.contains(created))
+        {
+            auto const checkpoint_folder = output_folder + cc::format("checkpoint_{:05}/", created);
+            LOG("Write checkpoint with {} created tokens to {}", created, checkpoint_folder);
+            util::make_directories(checkpoint_folder);
+            if (settings.checkpoint_sequences)
+            {
+                create_output_folders(checkpoint_folder, image_data, output_folder_count, settings);
+                write_sequences(image_data, checkpoint_folder, output_folder_count, settings);
+            }
+            else
+                util::make_directories(checkpoint_folder + "tokens/");
+            write_vocabulary_files(rules, tokens, checkpoint_folder, token_max + 1);
+        }
 
-        // output debug images
-        // write_images(cc::span(image_data).subspan(0, 1), transcribed_data_folder, iteration,output_folder_count, class_colors);
+        debug_sheets.render(image_data, iteration);
     }
+    debug_sheets.finish();
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
     LOG("Computation finished. Took {} ms", std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count());
 
     LOG("Output token sequences");
 
-    write_token_sequences(image_data, transcribed_data_folder, output_folder_count);
-
-    LOG("Output token shapes");
-
-    write_token_shapes(tokens, token_data_folder);
-
-    LOG("Output token rules");
+    write_sequences(image_data, output_folder, output_folder_count, settings);
 
-    write_rules(rules, output_folder);
+    write_vocabulary_files(rules, tokens, output_folder, token_max + 1);
 
     LOG("All done! Have a nice day!");
 }
 
-void tp::apply_rules(cc::span<rule const> rules, cc::span<token_data const> tokens, cc::span<image_data> images)
+void tp::apply_rules(cc::span<rule const> rules, cc::span<token_data const> tokens, cc::span<image_data> images, bool compress_inactive)
 {
     for (size_t i = 0; i < rules.size(); ++i)
     {
         auto const& rule = rules[i];
         auto const& new_token = tokens[rule.new_token_id];
-        apply_rule(rule, new_token, images);
+        apply_rule(rule, new_token, images, compress_inactive);
     }
 }
 
-void tp::apply_rules_to_folder(cc::string rule_file, cc::string token_folder, cc::string input_folder, cc::string output_folder, int output_folder_count)
+void tp::apply_rules_to_folder(
+    cc::string rule_file, cc::string token_folder, cc::string input_folder, cc::string output_folder, int output_folder_count, settings const& settings)
+{
+    LOG("Apply rules only");
+
+    LOG("Read rules and tokens");
+    auto const rules = read_rules(rule_file);
+    auto const tokens = read_tokens(token_folder);
+    apply_rules_to_folder(rules, tokens, cc::move(input_folder), cc::move(output_folder), output_folder_count, settings);
+}
+
+void tp::apply_vocabulary_to_folder(
+    cc::string vocabulary_file, cc::string input_folder, cc::string output_folder, int output_folder_count, settings const& settings)
 {
     LOG("Apply rules only");
 
+    LOG("Read vocabulary");
+    vocabulary vocabulary;
+    if (!read_vocabulary(vocabulary_file, vocabulary))
+        return;
+    apply_rules_to_folder(vocabulary.rules, vocabulary.tokens, cc::move(input_folder), cc::move(output_folder), output_folder_count, settings);
+}
+
+void tp::apply_rules_to_folder(cc::span<rule const> rules,
+                               cc::span<token_data const> tokens,
+                               cc::string input_folder,
+                               cc::string output_folder,
+                               int output_folder_count,
+                               settings const& settings)
+{
     LOG("Read input files");
-    auto rules = read_rules(rule_file);
-    auto tokens = read_tokens(token_folder);
-    auto images = read_folder(input_folder);
+    // the initial tokens are the input classes
+    auto images = read_input(input_folder, settings, int(tokens.size() - rules.size()));
 
     // output folders
     LOG("Create output folders");
     auto const transcribed_data_folder = output_folder + "transcribed_data/";
-    util::make_directories(transcribed_data_folder);
-    auto const token_data_folder = output_folder + "tokens/";
-    util::make_directories(token_data_folder);
-    for (auto const& image : images)
-    {
-        auto const folder = transcribed_data_folder + cc::format("{:06}/{:06}/", image.id % output_folder_count, image.id);
-        util::make_directories(folder);
-    }
+    create_output_folders(output_folder, images, output_folder_count, settings);
 
-    LOG("Apply rules");
-    apply_rules(rules, tokens, images);
-
-    LOG("Output token sequences");
+    if (settings.sequences != sequence_output::files)
+    {
+        LOG("Apply rules");
+        apply_rules(rules, tokens, images, settings.compress_inactive_images);
 
-    write_token_sequences(images, transcribed_data_folder, output_folder_count);
+        LOG("Output token sequences");
+        write_sequences(images, output_folder, output_folder_count, settings);
+    }
+    else
+    {
+        // rules are applied chunk by chunk, so the background writer outputs one chunk while the next is encoded
+        LOG("Apply rules and output token sequences");
+        auto const chunk_size = 4096;
+        sequence_writer writer(transcribed_data_folder, output_folder_count, settings);
+        for (auto begin = 0; begin < int(images.size()); begin += chunk_size)
+        {
+            auto const chunk = cc::span<image_data>(images).subspan(begin, tg::min(chunk_size, int(images.size()) - begin));
+            apply_rules(rules, tokens, chunk, settings.compress_inactive_images);
+            writer.submit(chunk);
+        }
+        writer.finish();
+    }
     LOG("All done! Have a nice day!");
 }
@@ -5,24 +5,61 @@
 #include "constellation.hh"
 #include "image_data.hh"
 #include "rule.hh"
+#include "settings.hh"
 #include "token_data.hh"
+#include "vocabulary.hh"
 
 namespace tp
 {
 /// tokenize the given images
-void tokenize(int token_max, int tokens_to_create, tg::isize2 const& image_size, cc::string input_folder, cc::string output_folder, int output_folder_count);
+void tokenize(int token_max,
+              int tokens_to_create,
+              tg::isize2 const& image_size,
+              cc::string input_folder,
+              cc::string output_folder,
+              int output_folder_count,
+              settings const& settings = {});
 
 /// apply a set of already computed tokens to a set of input images
-void apply_rules(cc::span<const rule> rules, cc::span<token_data const> tokens, cc::span<image_data> images);
+/// if 'compress_inactive' is set, images a rule did not change are kept lz4-compressed (see image_data::compress)
+void apply_rules(cc::span<const rule> rules, cc::span<token_data const> tokens, cc::span<image_data> images, bool compress_inactive = false);
+
+/// one iteration of tokenize: appends a rule for the most common constellation and its token, then applies it to all images
+/// returns false without changing anything if the images contain no constellation (e.g. every image is a single token)
+bool learn_rule(cc::vector<rule>& rules, cc::vector<token_data>& tokens, cc::span<image_data> images, bool compress_inactive = false);
+
+/// learns a vocabulary with up to 'tokens_to_create' new tokens from images in memory, without reading or writing any files
+/// stops early once no constellation is left, so the vocabulary can have fewer rules
+/// the classes of the images have to be in [0, class_count); afterwards the images are transcribed like after apply_rules
+vocabulary train_vocabulary(cc::span<image_data> images, int class_count, int tokens_to_create, bool compress_inactive = false);
 
 token_data combine_tokens(constellation const& rule, cc::span<token_data const> tokens);
 
-/// same as above, but reads the rules from a file
-void apply_rules_to_folder(cc::string rule_file, cc::string token_folder, cc::string input_folder, cc::string output_folder, int output_folder_count);
+/// apply the rules to all images of the input and write their token sequences into the output folder
+void apply_rules_to_folder(cc::span<rule const> rules,
+                           cc::span<token_data const> tokens,
+                           cc::string input_folder,
+                           cc::string output_folder,
+                           int output_folder_count,
+                           settings const& settings = {});
+
+/// same as above, but reads the rules from rules.dat and the tokens from the tokens/ folder
+void apply_rules_to_folder(cc::string rule_file,
+                           cc::string token_folder,
+                           cc::string input_folder,
+                           cc::string output_folder,
+                           int output_folder_count,
+                           settings const& settings = {});
+
+/// same as above, but reads rules and tokens from a single vocabulary file (see vocabulary.hh)
+void apply_vocabulary_to_folder(
+    cc::string vocabulary_file, cc::string input_folder, cc::string output_folder, int output_folder_count, settings const& settings = {});
 
-/// returns the most common constellation in the given images
+/// returns the most common constellation in the given images, a default constellation (class ids -1) if there is none
 constellation get_most_common_constellation(cc::span<image_data const> images);
 
 /// applies the given rule to all images
-void apply_rule(rule const& rule, token_data const& new_token, cc::span<image_data> images);
+/// compressed images are only decompressed if their class summary says the rule might apply
+/// if 'compress_inactive' is set, images the rule did not change are compressed afterwards
+void apply_rule(rule const& rule, token_data const& new_token, cc::span<image_data> images, bool compress_inactive = false);
 }
@@ -3,6 +3,26 @@
 #include <typed-geometry/feature/colors.hh>
 #include <typed-geometry/functions/random/shuffle.hh>
 
+bool tp::seek_file(std::FILE* file, int64_t offset, int origin)
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, origin) == 0;
+#else
+    if (int64_t(off_t(offset)) != offset) // 32 bit off_t
+        return false;
+    return fseeko(file, off_t(offset), origin) == 0;
+#endif
+}
+
+int64_t tp::tell_file(std::FILE* file)
+{
+#ifdef _WIN32
+    return _ftelli64(file);
+#else
+    return int64_t(ftello(file));
+#endif
+}
+
 cc::vector<tg::color3> tp::generate_colors(int count)
 {
     cc::vector<tg::color3> colors;
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
 #include <clean-core/vector.hh>
 
 #include <typed-geometry/types/color.hh>
@@ -9,4 +15,46 @@ namespace tp
 /// generate a set of 'count' colors on the HSL color wheel
 cc::vector<tg::color3> generate_colors(int count);
 
+/// std::fseek with a 64 bit offset (a long is 32 bit on Windows), returns false if the seek failed or the offset is not representable
+bool seek_file(std::FILE* file, int64_t offset, int origin = SEEK_SET);
+
+/// std::ftell with a 64 bit result, -1 on failure
+int64_t tell_file(std::FILE* file);
+
+/// reverses the byte order of a 32 bit integer
+constexpr int32_t byteswap(int32_t value)
+{
+    auto const v = uint32_t(value);
+    return int32_t((v >> 24) | ((v >> 8) & 0x0000ff00u) | ((v << 8) & 0x00ff0000u) | (v << 24));
+}
+
+/// reverses the byte order of a 64 bit integer
+constexpr int64_t byteswap(int64_t value)
+{
+    auto const v = uint64_t(value);
+    return int64_t(uint64_t(uint32_t(byteswap(int32_t(v)))) << 32 | uint32_t(byteswap(int32_t(v >> 32))));
+}
+
+/// reads a little-endian integer from unaligned memory
+template <class T>
+T read_le(std::byte const* data)
+{
+    T v;
+    std::memcpy(&v, data, sizeof(v));
+    if constexpr (std::endian::native == std::endian::big)
+        v = byteswap(v);
+    return v;
+}
+
+/// appends a little-endian integer to a byte buffer
+template <class T>
+void write_le(cc::vector<std::byte>& data, T v)
+{
+    if constexpr (std::endian::native == std::endian::big)
+        v = byteswap(v);
+    auto const offset = data.size();
+    data.resize(offset + sizeof(v));
+    std::memcpy(data.data() + offset, &v, sizeof(v));
+}
+
 }
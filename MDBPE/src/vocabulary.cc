@@ -0,0 +1,174 @@
+#include "vocabulary.hh"
+
+#include <cstring>
+
+#include <babel-serializer/file.hh>
+
+#include <rich-log/log.hh>
+
+#include "io.hh"
+#include "util.hh"
+
+namespace
+{
+constexpr char vocabulary_magic[4] = {'M', 'D', 'B', 'V'};
+constexpr int32_t vocabulary_version = 1;
+constexpr size_t vocabulary_header_bytes = sizeof(vocabulary_magic) + 4 * sizeof(int32_t) + sizeof(uint64_t);
+constexpr size_t rule_bytes = 5 * sizeof(int32_t);
+constexpr size_t token_entry_bytes = 2 * sizeof(int32_t) + sizeof(int64_t);
+constexpr size_t position_bytes = 3 * sizeof(int32_t);
+
+uint64_t fnv1a(cc::span<std::byte const> data)
+{
+    auto hash = uint64_t(0xcbf29ce484222325);
+    for (auto const b : data)
+    {
+        hash ^= uint64_t(uint8_t(b));
+        hash *= uint64_t(0x100000001b3);
+    }
+    return hash;
+}
+}
+
+bool tp::write_vocabulary(cc::string_view filepath, cc::span<rule const> rules, cc::span<token_data const> tokens, int class_count)
+{
+    cc::vector<std::byte> body;
+
+    for (auto const& rule : rules)
+    {
+        write_le<int32_t>(body, rule.constellation.source_class_id);
+        write_le<int32_t>(body, rule.constellation.target_class_id);
+        write_le<int32_t>(body, rule.constellation.ancor_offset.x);
+        write_le<int32_t>(body, rule.constellation.ancor_offset.y);
+        write_le<int32_t>(body, rule.new_token_id);
+    }
+
+    // positions follow the token table, offsets are from the start of the file
+    auto offset = int64_t(vocabulary_header_bytes + rules.size() * rule_bytes + tokens.size() * token_entry_bytes);
+    for (auto i = 0; i < int(tokens.size()); ++i)
+    {
+        auto const& token = tokens[i];
+        if (token.class_id != i || token.positions.size() != token.position_class.size())
+        {
+            LOG_ERROR("Token {} (class {}) is out of order or malformed, cannot write vocabulary: {}", i, token.class_id, filepath);
+            return false;
+        }
+        write_le<int32_t>(body, token.class_id);
+        write_le<int32_t>(body, int32_t(token.positions.size()));
+        write_le<int64_t>(body, offset);
+        offset += int64_t(token.positions.size() * position_bytes);
+    }
+    for (auto const& token : tokens)
+        for (size_t p = 0; p < token.positions.size(); ++p)
+        {
+            write_le<int32_t>(body, token.positions[p].x);
+            write_le<int32_t>(body, token.positions[p].y);
+            write_le<int32_t>(body, token.position_class[p]);
+        }
+
+    cc::vector<std::byte> data;
+    data.push_back_range(cc::span<std::byte const>(reinterpret_cast<std::byte const*>(vocabulary_magic), sizeof(vocabulary_magic)));
+    write_le<int32_t>(data, vocabulary_version);
+    write_le<int32_t>(data, class_count);
+    write_le<int32_t>(data, int32_t(rules.size()));
+    write_le<int32_t>(data, int32_t(tokens.size()));
+    write_le<int64_t>(data, int64_t(fnv1a(body)));
+    data.push_back_range(cc::span<std::byte const>(body));
+
+    return write_file_bytes(filepath, data);
+}
+
+bool tp::read_vocabulary(cc::string_view filepath, vocabulary& vocabulary)
+{
+    vocabulary = {};
+
+    if (!babel::file::exists(filepath))
+    {
+        LOG_ERROR("Vocabulary file does not exist: {}", filepath);
+        return false;
+    }
+
+    auto const file = babel::file::memory_mapped_file<std::byte const>(filepath);
+    auto const data = file.data();
+    auto const size = size_t(file.size());
+
+    if (size < vocabulary_header_bytes || std::memcmp(data, vocabulary_magic, sizeof(vocabulary_magic)) != 0)
+    {
+        LOG_ERROR("Not a vocabulary file: {}", filepath);
+        return false;
+    }
+    auto const version = read_le<int32_t>(data + 4);
+    if (version != vocabulary_version)
+    {
+        LOG_ERROR("Unsupported vocabulary version {}: {}", version, filepath);
+        return false;
+    }
+
+    auto const class_count = read_le<int32_t>(data + 8);
+    auto const rule_count = read_le<int32_t>(data + 12);
+    auto const token_count = read_le<int32_t>(data + 16);
+    auto const checksum = uint64_t(read_le<int64_t>(data + 20));
+    auto const tables_end = vocabulary_header_bytes + size_t(rule_count) * rule_bytes + size_t(token_count) * token_entry_bytes;
+    if (class_count < 0 || rule_count < 0 || token_count != class_count + rule_count || size < tables_end)
+    {
+        LOG_ERROR("Corrupt vocabulary header ({} classes, {} rules, {} tokens): {}", class_count, rule_count, token_count, filepath);
+        return false;
+    }
+    if (fnv1a(cc::span<std::byte const>(data + vocabulary_header_bytes, size - vocabulary_header_bytes)) != checksum)
+    {
+        LOG_ERROR("Vocabulary checksum mismatch, the file is corrupt: {}", filepath);
+        return false;
+    }
+
+    vocabulary.class_count = class_count;
+    vocabulary.rules.resize(rule_count);
+    auto pos = data + vocabulary_header_bytes;
+    for (auto& rule : vocabulary.rules)
+    {
+        rule.constellation.source_class_id = read_le<int32_t>(pos);
+        rule.constellation.target_class_id = read_le<int32_t>(pos + 4);
+        rule.constellation.ancor_offset.x = read_le<int32_t>(pos + 8);
+        rule.constellation.ancor_offset.y = read_le<int32_t>(pos + 12);
+        rule.new_token_id = read_le<int32_t>(pos + 16);
+        pos += rule_bytes;
+
+        // the encoder and decoder index tokens with these ids, so they have to lie in the token table
+        auto const& c = rule.constellation;
+        if (c.source_class_id < 0 || c.source_class_id >= token_count || c.target_class_id < 0 || c.target_class_id >= token_count
+            || rule.new_token_id < 0 || rule.new_token_id >= token_count)
+        {
+            LOG_ERROR("Rule {} of the vocabulary references a token outside of [0, {}): {}", &rule - vocabulary.rules.data(), token_count, filepath);
+            vocabulary = {};
+            return false;
+        }
+    }
+
+    vocabulary.tokens.resize(token_count);
+    for (auto i = 0; i < token_count; ++i)
+    {
+        auto& token = vocabulary.tokens[i];
+        token.class_id = read_le<int32_t>(pos);
+        auto const position_count = read_le<int32_t>(pos + 4);
+        auto const offset = read_le<int64_t>(pos + 8);
+        pos += token_entry_bytes;
+
+        if (token.class_id != i || position_count < 0 || offset < int64_t(tables_end)
+            || size_t(offset) + size_t(position_count) * position_bytes > size)
+        {
+            LOG_ERROR("Token {} of the vocabulary is malformed: {}", i, filepath);
+            vocabulary = {};
+            return false;
+        }
+
+        token.positions.resize(position_count);
+        token.position_class.resize(position_count);
+        auto const positions = data + offset;
+        for (auto p = 0; p < position_count; ++p)
+        {
+            token.positions[p] = tg::ipos2(read_le<int32_t>(positions + p * position_bytes), read_le<int32_t>(positions + p * position_bytes + 4));
+            token.position_class[p] = read_le<int32_t>(positions + p * position_bytes + 8);
+        }
+    }
+
+    return true;
+}
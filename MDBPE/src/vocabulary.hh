@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+#include <clean-core/span.hh>
+#include <clean-core/string_view.hh>
+#include <clean-core/vector.hh>
+
+#include "rule.hh"
+#include "token_data.hh"
+
+namespace tp
+{
+/// single-file vocabulary: the rules and token shapes of a tokenization (replaces rules.dat + tokens/token_XXXX.dat)
+///
+/// layout (little-endian):
+///   header:      magic "MDBV", int32 version, int32 class count (token_max + 1), int32 rule count, int32 token count,
+///                uint64 checksum (64 bit FNV-1a of everything after the header)
+///   rule table:  per rule int32 source class, int32 target class, int32 ancor offset x, int32 ancor offset y, int32 new token id
+///   token table: per token (in class id order) int32 class id, int32 position count, int64 byte offset of its positions
+///   positions:   per position int32 x, int32 y, int32 original class
+struct vocabulary
+{
+    int class_count = 0; // initial classes, i.e. tokens without a rule
+    cc::vector<rule> rules;
+    cc::vector<token_data> tokens; // tokens[i].class_id == i
+};
+
+/// writes a vocabulary file, 'tokens' must be in class id order (as tokenize creates them)
+bool write_vocabulary(cc::string_view filepath, cc::span<rule const> rules, cc::span<token_data const> tokens, int class_count);
+
+/// reads a vocabulary file through a single mmap; the checksum, all tables and the token ids of the rules are validated, errors are reported
+bool read_vocabulary(cc::string_view filepath, vocabulary& vocabulary);
+}